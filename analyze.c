@@ -0,0 +1,101 @@
+#include "analyze.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define PI 3.14159265358979323846
+
+void piep_goertzel(int16_t const *samples, size_t count, unsigned int rate_hz,
+        double const frequencies_hz[GOERTZEL_BINS], double amplitudes[GOERTZEL_BINS],
+        double phases[GOERTZEL_BINS]) {
+    double omega[GOERTZEL_BINS];
+    double coeff[GOERTZEL_BINS];
+    double s1[GOERTZEL_BINS];
+    double s2[GOERTZEL_BINS];
+    for (unsigned int bin = 0; bin < GOERTZEL_BINS; bin++) {
+        omega[bin] = 2.0 * PI * frequencies_hz[bin] / rate_hz;
+        coeff[bin] = 2.0 * cos(omega[bin]);
+        s1[bin] = 0.0;
+        s2[bin] = 0.0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        double x = samples[i] / 32768.0;
+        for (unsigned int bin = 0; bin < GOERTZEL_BINS; bin++) {
+            double s = x + coeff[bin] * s1[bin] - s2[bin];
+            s2[bin] = s1[bin];
+            s1[bin] = s;
+        }
+    }
+
+    for (unsigned int bin = 0; bin < GOERTZEL_BINS; bin++) {
+        if (frequencies_hz[bin] == 0.0 || count == 0) {
+            amplitudes[bin] = 0.0;
+            phases[bin] = 0.0;
+            continue;
+        }
+        // The final state gives the transform up to a rotation by the length
+        // of the input; undo that to refer the phase to the first sample.
+        double re = s1[bin] - cos(omega[bin]) * s2[bin];
+        double im = sin(omega[bin]) * s2[bin];
+        double rotation = omega[bin] * (count - 1);
+        double x_re = re * cos(rotation) + im * sin(rotation);
+        double x_im = im * cos(rotation) - re * sin(rotation);
+        amplitudes[bin] = 2.0 * hypot(x_re, x_im) / count;
+        phases[bin] = atan2(x_im, x_re);
+    }
+}
+
+double piep_measure_frequency(int16_t const *samples, size_t count, unsigned int rate_hz,
+        double expected_hz, size_t block_frames) {
+    double frequencies_hz[GOERTZEL_BINS] = { expected_hz };
+    double amplitudes[GOERTZEL_BINS];
+    double phases[GOERTZEL_BINS];
+    double advance = 2.0 * PI * expected_hz * block_frames / rate_hz;
+
+    // Sum up the drift of each block relative to the expected frequency. Per
+    // block it is small enough to unwrap; the sum spans the whole input.
+    double drift = 0.0;
+    double previous_phase = 0.0;
+    size_t num_blocks = 0;
+    for (size_t start = 0; start + block_frames <= count; start += block_frames, num_blocks++) {
+        piep_goertzel(samples + start, block_frames, rate_hz, frequencies_hz, amplitudes, phases);
+        // A tone that is a whole number of cycles per block off would drift
+        // by a whole number of turns, which looks like no drift at all. But
+        // then there is nothing at the expected frequency.
+        double energy = 0.0;
+        for (size_t i = start; i < start + block_frames; i++) {
+            energy += (samples[i] / 32768.0) * (samples[i] / 32768.0);
+        }
+        double rms = sqrt(energy / block_frames);
+        if (amplitudes[0] < 0.5 * sqrt(2.0) * rms) {
+            return NAN;
+        }
+        if (num_blocks > 0) {
+            drift += remainder(phases[0] - previous_phase - advance, 2.0 * PI);
+        }
+        previous_phase = phases[0];
+    }
+    if (num_blocks < 2) {
+        return expected_hz;
+    }
+    double span_s = (double) (num_blocks - 1) * block_frames / rate_hz;
+    return expected_hz + drift / (2.0 * PI * span_s);
+}
+
+unsigned int piep_max_step(int16_t const *samples, size_t count, bool wrap) {
+    unsigned int max = 0;
+    for (size_t i = 1; i < count; i++) {
+        unsigned int step = abs(samples[i] - samples[i - 1]);
+        if (step > max) {
+            max = step;
+        }
+    }
+    if (wrap && count > 0) {
+        unsigned int step = abs(samples[0] - samples[count - 1]);
+        if (step > max) {
+            max = step;
+        }
+    }
+    return max;
+}
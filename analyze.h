@@ -0,0 +1,35 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Signal analysis for checking what piep produces. Samples are 16-bit, and
+// amplitudes are returned relative to full scale.
+
+// Number of frequencies that piep_goertzel() analyses in a single pass. The
+// bins run side by side, so that the compiler can turn the inner loop into
+// SIMD instructions.
+#define GOERTZEL_BINS 8
+
+// Computes the amplitude and phase of each of the given frequencies over the
+// samples, using the Goertzel algorithm. The phase is that of a cosine at the
+// first sample. Frequencies of 0 are skipped and get an amplitude of 0.
+void piep_goertzel(int16_t const *samples, size_t count, unsigned int rate_hz,
+        double const frequencies_hz[GOERTZEL_BINS], double amplitudes[GOERTZEL_BINS],
+        double phases[GOERTZEL_BINS]);
+
+// Measures the frequency of a tone that is expected to be close to the given
+// frequency, by how far its phase drifts from that frequency from one block
+// of samples to the next. This is far more precise than the resolution of a
+// single transform. The true frequency must be within half a cycle per block
+// of the expected one. Returns NaN if the tone is too far off to be found.
+double piep_measure_frequency(int16_t const *samples, size_t count, unsigned int rate_hz,
+        double expected_hz, size_t block_frames);
+
+// Returns the largest difference between adjacent samples. If wrap is true,
+// the last sample is also compared to the first, as happens when looping.
+unsigned int piep_max_step(int16_t const *samples, size_t count, bool wrap);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "libpiep.h"
+#include "rawpcm.h"
+
+#include <alsa/asoundlib.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Parts of the engine that piep --verify drives directly, to check playback
+// without a sound card. They are not part of the library's API, which is all
+// in libpiep.h.
+
+// The sample rate we ask for unless told otherwise.
+#define DEFAULT_RATE_HZ 44100
+
+// The period time we ask for initially. Long periods mean few wakeups.
+#define PERIOD_TIME_US 1000000
+
+// The buffer holds this many periods.
+#define BUFFER_PERIODS 3
+
+// Tone clips are at most this long. Within it, a tone can come as close as
+// half a hertz to the requested frequency, whatever the period size.
+#define TONE_MAX_CLIP_TIME_S 1
+
+// What the engine plays, for checking it against what it should be.
+struct piep_source {
+    // The clip that a tone or noise loops, or NULL for a sweep.
+    int16_t const *clip;
+    unsigned int clip_size_frames;
+    // The frequency of a tone, rounded to whole waves per clip, and how many
+    // of its harmonics the wavetable holds.
+    double frequency_hz;
+    unsigned int num_harmonics;
+    // Frames after which a sweep starts over.
+    size_t sweep_size_frames;
+};
+
+// Opens an engine for the configuration like piep_open does, but on a device
+// that the caller has already set up with the given rate, period and buffer
+// size: either an alsa-lib stream, with or without mmap access, or a raw
+// device. The engine takes the device over, and closes it even on failure.
+// Its buffer never grows.
+int piep_open_output(struct piep **piep, struct piep_config const *config, snd_pcm_t *pcm, bool mmap,
+        struct raw_pcm *raw, unsigned int rate_hz, snd_pcm_uframes_t period_size_frames,
+        snd_pcm_uframes_t buffer_size_frames);
+
+// Writes once, like piep_handle_events does until the device is full, and
+// returns -EAGAIN when it is.
+int piep_write_period(struct piep *piep);
+
+// Waits until a sweep's producer is far enough ahead that the engine can fill
+// the whole buffer from the ring. Rendering faster than real time would
+// otherwise run it dry, and play silence.
+void piep_wait_for_producer(struct piep *piep);
+
+void piep_get_source(struct piep const *piep, struct piep_source *source);
+
+// Fills the buffer with what the engine should play from its start, straight
+// from the source.
+void piep_render_source(struct piep const *piep, int16_t *buffer, size_t frames);
+
+// Returns the amplitude of the given harmonic (1 being the fundamental) in
+// the Fourier series of a waveform with a peak amplitude of 1.
+float piep_harmonic_amplitude(enum piep_waveform waveform, unsigned int harmonic);
+
+#endif
@@ -0,0 +1,1840 @@
+#define _GNU_SOURCE
+
+#include "libpiep.h"
+
+#include <alsa/asoundlib.h>
+
+#include <alloca.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include "engine.h"
+#include "rawpcm.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PI 3.1415926535897932384626433
+
+// Reports a failed call on the log, if there is one. What to do about the
+// error is up to the program.
+#define REPORT(log, fn, err) \
+    do { \
+        if (log) { \
+            fprintf(log, "ALSA error: %s: %s\n", #fn, snd_strerror(err)); \
+        } \
+    } while (0)
+
+// Checks the result of a call, and on failure reports it and hands the error
+// back to our caller.
+#define TRY(log, fn, ...) \
+    do { \
+        int err = fn(__VA_ARGS__); \
+        if (err < 0) { \
+            REPORT(log, fn, err); \
+            return err; \
+        } \
+    } while (0)
+
+typedef int16_t sample;
+
+// Band-limited wavetables hold this many points per cycle. Must be a power of
+// two so that table indices can wrap around with a mask.
+#define WAVETABLE_SIZE 2048
+
+// Wavetables are mipmapped per octave. Level 0 holds WAVETABLE_SIZE / 4
+// harmonics, and each following level holds half as many as the one before,
+// down to just the fundamental.
+#define WAVETABLE_LEVELS 10
+
+// Noise does not loop after a single period, because that would make it
+// periodic at the period rate. Instead, we precompute at least this much.
+#define NOISE_LOOP_TIME_S 4
+
+// Number of independent xorshift generators that are stepped in lockstep, so
+// that the compiler can vectorize the noise generation loop.
+#define XORSHIFT_LANES 8
+
+char const *const piep_waveform_names[PIEP_WAVEFORM_COUNT] = {
+    "sine", "square", "triangle", "saw", "white", "pink"
+};
+
+// A WAV file that is memory-mapped in its entirety.
+struct wav {
+    void *map;
+    size_t map_size;
+    unsigned int format_tag;
+    unsigned int channels;
+    unsigned int rate_hz;
+    unsigned int bits_per_sample;
+    unsigned int block_align;
+    unsigned char const *data;
+    size_t num_frames;
+};
+
+// The sweep oscillator recomputes its rotation once per block this long, and
+// renormalizes its amplitude at the same time.
+#define SWEEP_BLOCK_FRAMES 64
+
+// When the sweep producer falls behind, we play silence in blocks this long,
+// so that the sweep resumes as soon as it catches up.
+#define SILENCE_FRAMES 256
+
+// A sine sweep from one frequency to another, which then starts over.
+struct sweep {
+    bool logarithmic;
+    float start_hz;
+    float end_hz;
+    float duration_s;
+    unsigned int rate_hz;
+    float amplitude;
+    // Frames since the start of the current sweep.
+    uint64_t frame;
+    // Oscillator state: a unit vector in the complex plane that rotates at
+    // the instantaneous frequency.
+    float re;
+    float im;
+    // Rotation per frame within the current block, and how that rotation
+    // itself rotates from one frame to the next.
+    float w_re;
+    float w_im;
+    float dw_re;
+    float dw_im;
+};
+
+// Single-producer single-consumer ring buffer of frames. The indices run
+// freely and are only wrapped when accessing the buffer. Each is written by
+// one thread only, so no locks are needed.
+struct ring {
+    sample *buffer;
+    size_t size_frames;
+    size_t head;
+    size_t tail;
+    // Posted by the consumer when it frees up space, so that the producer can
+    // sleep while the ring is full.
+    sem_t space;
+};
+
+// Underruns within ADAPT_WINDOW_S that make us grow the buffer.
+#define ADAPT_GROW_UNDERRUNS 2
+#define ADAPT_WINDOW_S 600
+// We also grow the buffer if it came close to running empty: if at the
+// start of a write, less than this fraction of a period was left to play.
+#define ADAPT_MIN_HEADROOM_PERIODS 0.5
+// After this long without any trouble, we shrink the buffer again.
+#define ADAPT_SHRINK_AFTER_S (6 * 3600)
+// We never ask for periods longer than this many times PERIOD_TIME_US. That
+// is more than devices offer anyway, and keeps the buffer time we ask for
+// well within an unsigned int.
+#define ADAPT_MAX_SCALE 64
+
+// Hardware parameters that are cached between runs, so that we don't have to
+// negotiate them again. The request is stored too, because a cache entry is
+// only valid for the request that produced it.
+struct pcm_params {
+    unsigned int requested_rate_hz;
+    unsigned int requested_period_time_us;
+    unsigned int rate_hz;
+    snd_pcm_uframes_t period_size_frames;
+    snd_pcm_uframes_t buffer_size_frames;
+    // Not cached, but queried each time.
+    snd_pcm_uframes_t max_buffer_size_frames;
+};
+
+// State of the policy that adapts the buffer size to the underruns we see.
+// The requested period time is PERIOD_TIME_US times the scale, which is
+// always a power of two.
+struct adaptation {
+    unsigned int scale;
+    // Growing beyond this scale didn't make the buffer any larger.
+    unsigned int max_scale;
+    double window_start_s;
+    unsigned int window_underruns;
+    double last_trouble_s;
+    // Smallest number of frames left to play at the start of a write, since
+    // the last decision.
+    snd_pcm_sframes_t min_headroom_frames;
+};
+
+// The device we play to. Exactly one of these is set, depending on whether we
+// go through alsa-lib or straight to the kernel's PCM interface.
+struct output {
+    snd_pcm_t *pcm;
+    struct raw_pcm *raw;
+    // Whether the alsa-lib stream has mmap access, so we can write into its
+    // buffer directly.
+    bool mmap;
+    // Without mmap access, short clips are tiled into this first, so that
+    // each write hands over as many frames as it can.
+    sample *scratch;
+    snd_pcm_uframes_t scratch_size_frames;
+};
+
+struct piep {
+    struct piep_config config;
+    // The log, if the configuration asks for verbose output.
+    FILE *verbose_log;
+
+    struct output out;
+    snd_pcm_hw_params_t *hw_params;
+    struct pcm_params params;
+    bool have_timestamps;
+    bool started_once;
+
+    struct wav wav;
+    bool wav_mapped;
+
+    // The samples we loop over. To avoid confusion with ALSA's internal
+    // buffer, we call this a "clip". It points into one of the buffers below,
+    // or straight at the file's data. Sweeps don't repeat, so they are
+    // synthesized on the fly by the producer instead.
+    sample const *clip;
+    unsigned int clip_size_frames;
+    unsigned int clip_offset_frames;
+    sample *generated_clip;
+    sample *converted_clip;
+    struct sweep_producer *producer;
+    pthread_t thread;
+    bool thread_running;
+    // Played when the sweep producer falls behind.
+    sample *silence;
+
+    // Frames written since the stream was last prepared. Until this reaches
+    // the buffer size, the stream has not been started.
+    snd_pcm_uframes_t preroll_frames;
+    struct adaptation adapt;
+    struct piep_stats stats;
+};
+
+static bool is_noise(enum piep_waveform waveform) {
+    return waveform == PIEP_WAVEFORM_WHITE || waveform == PIEP_WAVEFORM_PINK;
+}
+
+float piep_harmonic_amplitude(enum piep_waveform waveform, unsigned int harmonic) {
+    switch (waveform) {
+        case PIEP_WAVEFORM_SINE:
+            return harmonic == 1 ? 1.0f : 0.0f;
+        case PIEP_WAVEFORM_SQUARE:
+            return harmonic % 2 ? 4.0f / (PI * harmonic) : 0.0f;
+        case PIEP_WAVEFORM_TRIANGLE:
+            if (harmonic % 2 == 0) {
+                return 0.0f;
+            }
+            return (harmonic % 4 == 1 ? 8.0f : -8.0f) / (PI * PI * harmonic * harmonic);
+        case PIEP_WAVEFORM_SAW:
+            return (harmonic % 2 ? 2.0f : -2.0f) / (PI * harmonic);
+        default:
+            return 0.0f;
+    }
+}
+
+// Returns the mipmap level with the most harmonics that all stay below the
+// Nyquist frequency when played back at the given frequency.
+static unsigned int wavetable_level(float frequency_hz, unsigned int rate_hz) {
+    float max_harmonics = 0.5f * rate_hz / frequency_hz;
+    unsigned int level = 0;
+    while (level < WAVETABLE_LEVELS - 1 && (WAVETABLE_SIZE / 4 >> level) > max_harmonics) {
+        level++;
+    }
+    return level;
+}
+
+// Fills a table of WAVETABLE_SIZE points with one cycle of the given waveform,
+// band-limited to the harmonics of the given mipmap level. The result is
+// normalized to a peak amplitude of 1, which also takes care of the overshoot
+// caused by the Gibbs phenomenon. Returns 0, or -ENOMEM.
+static int wavetable_fill(float *table, enum piep_waveform waveform, unsigned int level) {
+    // Since every harmonic completes an integer number of cycles in the table,
+    // we can look up all of them in a single table of the fundamental.
+    float *fundamental = malloc(WAVETABLE_SIZE * sizeof(float));
+    if (!fundamental) {
+        return -ENOMEM;
+    }
+    for (unsigned int i = 0; i < WAVETABLE_SIZE; i++) {
+        fundamental[i] = sinf((float) i / WAVETABLE_SIZE * 2.0 * PI);
+        table[i] = 0.0f;
+    }
+    unsigned int num_harmonics = WAVETABLE_SIZE / 4 >> level;
+    for (unsigned int harmonic = 1; harmonic <= num_harmonics; harmonic++) {
+        float amplitude = piep_harmonic_amplitude(waveform, harmonic);
+        if (amplitude == 0.0f) {
+            continue;
+        }
+        for (unsigned int i = 0; i < WAVETABLE_SIZE; i++) {
+            table[i] += amplitude * fundamental[(i * harmonic) & (WAVETABLE_SIZE - 1)];
+        }
+    }
+    free(fundamental);
+
+    float peak = 0.0f;
+    for (unsigned int i = 0; i < WAVETABLE_SIZE; i++) {
+        peak = fmaxf(peak, fabsf(table[i]));
+    }
+    for (unsigned int i = 0; i < WAVETABLE_SIZE; i++) {
+        table[i] /= peak;
+    }
+    return 0;
+}
+
+// Fills the clip with an integer number of cycles from the wavetable, so that
+// it loops seamlessly.
+static void fill_wavetable_clip(sample *clip, unsigned int clip_size_frames, float const *table,
+        unsigned int cycles_per_clip, float amplitude) {
+    for (unsigned int i = 0; i < clip_size_frames; i++) {
+        // Compute the phase exactly, so that errors don't accumulate and the
+        // last frame lines up with the first.
+        uint64_t position = (uint64_t) i * cycles_per_clip * WAVETABLE_SIZE;
+        unsigned int index = position / clip_size_frames;
+        float fraction = (float) (position % clip_size_frames) / clip_size_frames;
+        float a = table[index & (WAVETABLE_SIZE - 1)];
+        float b = table[(index + 1) & (WAVETABLE_SIZE - 1)];
+        clip[i] = (sample) ((a + fraction * (b - a)) * amplitude * 0x7FFF);
+    }
+}
+
+// Several xorshift32 generators that run side by side. Each lane is an
+// independent generator; keeping them in an array lets the compiler turn the
+// inner loop into SIMD instructions.
+struct xorshift {
+    uint32_t state[XORSHIFT_LANES];
+};
+
+static void xorshift_seed(struct xorshift *rng, uint32_t seed) {
+    // Spread the seed over the lanes with a splitmix32 step, so that they
+    // don't produce correlated sequences. Xorshift state must not be zero.
+    for (unsigned int lane = 0; lane < XORSHIFT_LANES; lane++) {
+        uint32_t z = (seed += 0x9E3779B9u);
+        z = (z ^ (z >> 16)) * 0x85EBCA6Bu;
+        z = (z ^ (z >> 13)) * 0xC2B2AE35u;
+        z ^= z >> 16;
+        rng->state[lane] = z ? z : 1;
+    }
+}
+
+// Fills the buffer with uniform white noise in the range [-1, 1).
+static void xorshift_fill(struct xorshift *rng, float *buffer, size_t count) {
+    float block[XORSHIFT_LANES];
+    for (size_t i = 0; i < count; i += XORSHIFT_LANES) {
+        for (unsigned int lane = 0; lane < XORSHIFT_LANES; lane++) {
+            uint32_t x = rng->state[lane];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            rng->state[lane] = x;
+            block[lane] = (float) (int32_t) x * (1.0f / 2147483648.0f);
+        }
+        size_t n = count - i < XORSHIFT_LANES ? count - i : XORSHIFT_LANES;
+        memcpy(buffer + i, block, n * sizeof(float));
+    }
+}
+
+// Turns white noise into pink noise in place, using Paul Kellet's economy
+// filter (three first-order lowpass filters, accurate to within 0.5 dB above
+// 9 Hz at 44.1 kHz).
+static void pink_filter(float *buffer, size_t count) {
+    float b0 = 0.0f, b1 = 0.0f, b2 = 0.0f;
+    // The buffer is played as a loop, so its input is periodic. Running the
+    // filter over it once without output brings the filter into the state it
+    // will have when the loop wraps around, which makes the loop seamless.
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            float white = buffer[i];
+            b0 = 0.99765f * b0 + white * 0.0990460f;
+            b1 = 0.96300f * b1 + white * 0.2965164f;
+            b2 = 0.57000f * b2 + white * 1.0526913f;
+            if (pass == 1) {
+                buffer[i] = b0 + b1 + b2 + white * 0.1848f;
+            }
+        }
+    }
+}
+
+// Fills the clip with white or pink noise. Returns 0, or -ENOMEM.
+static int fill_noise_clip(sample *clip, unsigned int clip_size_frames, enum piep_waveform waveform,
+        float amplitude) {
+    float *noise = malloc(clip_size_frames * sizeof(float));
+    if (!noise) {
+        return -ENOMEM;
+    }
+    struct xorshift rng;
+    xorshift_seed(&rng, 0x70696570u);
+    xorshift_fill(&rng, noise, clip_size_frames);
+    if (waveform == PIEP_WAVEFORM_PINK) {
+        pink_filter(noise, clip_size_frames);
+    }
+
+    float peak = 0.0f;
+    for (unsigned int i = 0; i < clip_size_frames; i++) {
+        peak = fmaxf(peak, fabsf(noise[i]));
+    }
+    float scale = amplitude * 0x7FFF / peak;
+    for (unsigned int i = 0; i < clip_size_frames; i++) {
+        clip[i] = (sample) (noise[i] * scale);
+    }
+    free(noise);
+    return 0;
+}
+
+static uint32_t read_le16(unsigned char const *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t read_le32(unsigned char const *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// Locates the format and data chunks in the mapped file. Returns what is
+// wrong with the file, or NULL if nothing is.
+static char const *wav_parse(struct wav *wav) {
+    unsigned char const *bytes = wav->map;
+    unsigned char const *end = bytes + wav->map_size;
+    if (memcmp(bytes, "RIFF", 4) != 0 || memcmp(bytes + 8, "WAVE", 4) != 0) {
+        return "not a RIFF WAVE file";
+    }
+    bool have_format = false;
+    size_t data_size = 0;
+    wav->data = NULL;
+    for (unsigned char const *chunk = bytes + 12; end - chunk >= 8; ) {
+        size_t chunk_size = read_le32(chunk + 4);
+        unsigned char const *body = chunk + 8;
+        if (chunk_size > (size_t) (end - body)) {
+            // Writers that stream to a pipe often leave the size unset, so
+            // just take whatever is there.
+            chunk_size = end - body;
+        }
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16) {
+            wav->format_tag = read_le16(body);
+            wav->channels = read_le16(body + 2);
+            wav->rate_hz = read_le32(body + 4);
+            wav->block_align = read_le16(body + 12);
+            wav->bits_per_sample = read_le16(body + 14);
+            if (wav->format_tag == 0xFFFE && chunk_size >= 26) {
+                // WAVE_FORMAT_EXTENSIBLE: the real tag starts the subformat GUID.
+                wav->format_tag = read_le16(body + 24);
+            }
+            have_format = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            wav->data = body;
+            data_size = chunk_size;
+        }
+        // Chunks are padded to an even size.
+        chunk = body + chunk_size + (chunk_size & 1);
+    }
+    if (!have_format || wav->data == NULL) {
+        return "missing fmt or data chunk";
+    }
+    bool is_int = wav->format_tag == 1 && (wav->bits_per_sample == 8 || wav->bits_per_sample == 16 ||
+        wav->bits_per_sample == 24 || wav->bits_per_sample == 32);
+    bool is_float = wav->format_tag == 3 && (wav->bits_per_sample == 32 || wav->bits_per_sample == 64);
+    if (!is_int && !is_float) {
+        return "unsupported sample format";
+    }
+    if (wav->channels == 0 || wav->rate_hz == 0 || wav->block_align != wav->channels * wav->bits_per_sample / 8) {
+        return "invalid fmt chunk";
+    }
+    wav->num_frames = data_size / wav->block_align;
+    if (wav->num_frames == 0) {
+        return "no audio data";
+    }
+    return NULL;
+}
+
+// Maps the WAV file into memory and locates its format and data chunks.
+// Nothing is copied, so the data can later be played straight from the
+// mapped pages. Problems are reported on the log, if any.
+static int wav_map(char const *path, struct wav *wav, FILE *log) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        int err = -errno;
+        if (log) {
+            fprintf(log, "%s: %s\n", path, strerror(errno));
+        }
+        return err;
+    }
+    struct stat st;
+    int err = 0;
+    char const *problem = NULL;
+    if (fstat(fd, &st) < 0) {
+        err = -errno;
+        problem = strerror(errno);
+    } else if ((wav->map_size = st.st_size) < 12) {
+        err = -EINVAL;
+        problem = "file too short";
+    } else if ((wav->map = mmap(NULL, wav->map_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        err = -errno;
+        problem = strerror(errno);
+    } else if ((problem = wav_parse(wav)) != NULL) {
+        err = -EINVAL;
+        munmap(wav->map, wav->map_size);
+    }
+    close(fd);
+    if (problem && log) {
+        fprintf(log, "%s: %s\n", path, problem);
+    }
+    return err;
+}
+
+// Returns true if the file's data can be sent to the device as is.
+static bool wav_matches_pcm(struct wav const *wav, unsigned int rate_hz) {
+    return wav->format_tag == 1 && wav->bits_per_sample == 16 && wav->channels == 1 &&
+        wav->rate_hz == rate_hz && SND_PCM_FORMAT_S16 == SND_PCM_FORMAT_S16_LE &&
+        (uintptr_t) wav->data % sizeof(sample) == 0;
+}
+
+// Returns the given sample of the WAV file, scaled to the range [-1, 1].
+static float wav_sample(struct wav const *wav, size_t frame, unsigned int channel) {
+    unsigned char const *p = wav->data + frame * wav->block_align + channel * wav->bits_per_sample / 8;
+    if (wav->format_tag == 3) {
+        if (wav->bits_per_sample == 32) {
+            float value;
+            memcpy(&value, p, sizeof(value));
+            return value;
+        } else {
+            double value;
+            memcpy(&value, p, sizeof(value));
+            return value;
+        }
+    }
+    switch (wav->bits_per_sample) {
+        case 8:
+            return (p[0] - 128) / 128.0f;
+        case 16:
+            return (int16_t) read_le16(p) / 32768.0f;
+        case 24:
+            return (int32_t) (p[0] << 8 | p[1] << 16 | (uint32_t) p[2] << 24) / 2147483648.0f;
+        default:
+            return (int32_t) read_le32(p) / 2147483648.0f;
+    }
+}
+
+// Converts the WAV file to the format of the clip, mixing down to mono and
+// resampling linearly to the given rate. This happens only once, at startup.
+// Returns the newly allocated clip, or NULL if there is no memory for it.
+static sample *wav_convert(struct wav const *wav, unsigned int rate_hz, unsigned int *clip_size_frames) {
+    size_t num_frames = ((uint64_t) wav->num_frames * rate_hz + wav->rate_hz / 2) / wav->rate_hz;
+    if (num_frames == 0) {
+        num_frames = 1;
+    }
+    sample *clip = malloc(num_frames * sizeof(sample));
+    if (!clip) {
+        return NULL;
+    }
+    for (size_t i = 0; i < num_frames; i++) {
+        double position = (double) i * wav->rate_hz / rate_hz;
+        size_t index = position;
+        float fraction = position - index;
+        // Interpolate towards the start of the file, since it is looped.
+        size_t next = (index + 1) % wav->num_frames;
+        float mix = 0.0f;
+        for (unsigned int channel = 0; channel < wav->channels; channel++) {
+            float a = wav_sample(wav, index, channel);
+            float b = wav_sample(wav, next, channel);
+            mix += a + fraction * (b - a);
+        }
+        mix /= wav->channels;
+        clip[i] = (sample) (fmaxf(-1.0f, fminf(mix, 32767.0f / 32768.0f)) * 32768.0f);
+    }
+    *clip_size_frames = num_frames;
+    return clip;
+}
+
+// Returns the instantaneous frequency at the given time into the sweep.
+static float sweep_frequency(struct sweep const *sweep, float time_s) {
+    float t = time_s / sweep->duration_s;
+    if (sweep->logarithmic) {
+        return sweep->start_hz * powf(sweep->end_hz / sweep->start_hz, t);
+    } else {
+        return sweep->start_hz + t * (sweep->end_hz - sweep->start_hz);
+    }
+}
+
+static void sweep_init(struct sweep *sweep, struct piep_config const *config, unsigned int rate_hz) {
+    *sweep = (struct sweep) {
+        .logarithmic = config->sweep == PIEP_SWEEP_LOGARITHMIC,
+        .start_hz = config->frequency_hz,
+        .end_hz = config->end_frequency_hz,
+        .duration_s = config->sweep_time_s,
+        .rate_hz = rate_hz,
+        .amplitude = config->amplitude,
+        .re = 1.0f,
+    };
+}
+
+// Synthesizes the next frames of the sweep. Rather than calling sinf for every
+// sample, this rotates the oscillator state by a complex factor, which itself
+// rotates to make the frequency change linearly within each block. Blocks
+// always start at multiples of SWEEP_BLOCK_FRAMES into the sweep, however
+// the frames are asked for, so the outcome doesn't depend on that.
+static void sweep_fill(struct sweep *sweep, sample *buffer, size_t count) {
+    float scale = sweep->amplitude * 0x7FFF;
+    size_t n;
+    for (size_t i = 0; i < count; i += n) {
+        unsigned int position = sweep->frame % SWEEP_BLOCK_FRAMES;
+        if (position == 0) {
+            float start_hz = sweep_frequency(sweep, (float) sweep->frame / sweep->rate_hz);
+            float end_hz = sweep_frequency(sweep, (float) (sweep->frame + SWEEP_BLOCK_FRAMES) / sweep->rate_hz);
+            float step = 2.0 * PI * start_hz / sweep->rate_hz;
+            float step_step = 2.0 * PI * (end_hz - start_hz) / sweep->rate_hz / SWEEP_BLOCK_FRAMES;
+            sweep->w_re = cosf(step);
+            sweep->w_im = sinf(step);
+            sweep->dw_re = cosf(step_step);
+            sweep->dw_im = sinf(step_step);
+        }
+
+        float re = sweep->re, im = sweep->im;
+        float w_re = sweep->w_re, w_im = sweep->w_im;
+        n = count - i < SWEEP_BLOCK_FRAMES - position ? count - i : SWEEP_BLOCK_FRAMES - position;
+        for (size_t j = 0; j < n; j++) {
+            // Clamp, because the magnitude can be a hair above 1.
+            buffer[i + j] = (sample) fmaxf(-0x7FFF, fminf(im * scale, 0x7FFF));
+            float next_re = re * w_re - im * w_im;
+            im = re * w_im + im * w_re;
+            re = next_re;
+            float next_w_re = w_re * sweep->dw_re - w_im * sweep->dw_im;
+            w_im = w_re * sweep->dw_im + w_im * sweep->dw_re;
+            w_re = next_w_re;
+        }
+        sweep->w_re = w_re;
+        sweep->w_im = w_im;
+        sweep->frame += n;
+        if (sweep->frame % SWEEP_BLOCK_FRAMES != 0) {
+            sweep->re = re;
+            sweep->im = im;
+            continue;
+        }
+
+        // Rounding errors make the magnitude drift. One Newton step towards
+        // 1 / |z| is plenty to pull it back, since the drift is tiny.
+        float correction = 0.5f * (3.0f - (re * re + im * im));
+        sweep->re = re * correction;
+        sweep->im = im * correction;
+        if (sweep->frame >= sweep->duration_s * sweep->rate_hz) {
+            sweep->frame = 0;
+        }
+    }
+}
+
+// Gives the ring a new, empty buffer that holds at least the given number of
+// frames. Returns -ENOMEM, leaving the ring as it was, if there is no memory
+// for it.
+static int ring_resize(struct ring *ring, size_t min_size_frames) {
+    size_t size_frames = 1;
+    while (size_frames < min_size_frames) {
+        size_frames *= 2;
+    }
+    sample *buffer = malloc(size_frames * sizeof(sample));
+    if (!buffer) {
+        return -ENOMEM;
+    }
+    free(ring->buffer);
+    ring->buffer = buffer;
+    ring->size_frames = size_frames;
+    ring->head = 0;
+    ring->tail = 0;
+    return 0;
+}
+
+static int ring_init(struct ring *ring, size_t min_size_frames) {
+    ring->buffer = NULL;
+    sem_init(&ring->space, 0, 0);
+    return ring_resize(ring, min_size_frames);
+}
+
+// Returns the number of frames that the producer can write contiguously at
+// the head, and points *frames at them.
+static size_t ring_write_space(struct ring *ring, sample **frames) {
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = ring->head & (ring->size_frames - 1);
+    size_t space = ring->size_frames - (ring->head - tail);
+    if (space > ring->size_frames - offset) {
+        space = ring->size_frames - offset;
+    }
+    *frames = ring->buffer + offset;
+    return space;
+}
+
+static void ring_produce(struct ring *ring, size_t count) {
+    __atomic_store_n(&ring->head, ring->head + count, __ATOMIC_RELEASE);
+}
+
+// Returns the number of frames that the consumer can read contiguously at
+// the tail, and points *frames at them.
+static size_t ring_read_space(struct ring *ring, sample const **frames) {
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t offset = ring->tail & (ring->size_frames - 1);
+    size_t available = head - ring->tail;
+    if (available > ring->size_frames - offset) {
+        available = ring->size_frames - offset;
+    }
+    *frames = ring->buffer + offset;
+    return available;
+}
+
+static void ring_consume(struct ring *ring, size_t count) {
+    __atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+    sem_post(&ring->space);
+}
+
+struct sweep_producer {
+    struct sweep sweep;
+    struct ring ring;
+    // Set when the thread should exit.
+    bool stop;
+};
+
+// Fills the ring with the sweep as far as it will go.
+static void sweep_produce(struct sweep_producer *producer) {
+    sample *frames;
+    size_t count;
+    while ((count = ring_write_space(&producer->ring, &frames)) > 0) {
+        sweep_fill(&producer->sweep, frames, count);
+        ring_produce(&producer->ring, count);
+    }
+}
+
+// Thread that keeps the ring topped up, sleeping whenever it is full.
+static void *sweep_thread(void *arg) {
+    struct sweep_producer *producer = arg;
+    while (!__atomic_load_n(&producer->stop, __ATOMIC_ACQUIRE)) {
+        sweep_produce(producer);
+        while (sem_wait(&producer->ring.space) < 0 && errno == EINTR) {
+        }
+    }
+    return NULL;
+}
+
+// Starts the thread that keeps the producer's ring topped up.
+static int start_producer(struct piep *piep) {
+    // Leave all signals to the program's own threads.
+    sigset_t signals, old_signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+    int err = pthread_create(&piep->thread, NULL, sweep_thread, piep->producer);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (err) {
+        if (piep->config.log) {
+            fprintf(piep->config.log, "pthread_create: %s\n", strerror(err));
+        }
+        return -err;
+    }
+    piep->thread_running = true;
+    return 0;
+}
+
+static void stop_producer(struct piep *piep) {
+    if (piep->thread_running) {
+        __atomic_store_n(&piep->producer->stop, true, __ATOMIC_RELEASE);
+        sem_post(&piep->producer->ring.space);
+        pthread_join(piep->thread, NULL);
+        piep->thread_running = false;
+        piep->producer->stop = false;
+    }
+}
+
+// Touches every page of the buffer, so that the first real access doesn't
+// page fault.
+static void prefault(void const *buffer, size_t size) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile unsigned char const *bytes = buffer;
+    for (size_t i = 0; i < size; i += page_size) {
+        (void) bytes[i];
+    }
+    if (size > 0) {
+        (void) bytes[size - 1];
+    }
+}
+
+// Writes the path of the parameter cache file for the given device into
+// path. Returns false if there is no runtime directory to put it in.
+static bool params_cache_path(char *path, size_t size, char const *device) {
+    char const *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (!runtime_dir || !*runtime_dir) {
+        return false;
+    }
+    int length = snprintf(path, size, "%s/piep-", runtime_dir);
+    for (char const *c = device; *c && length < (int) size - 8; c++) {
+        path[length++] = isalnum((unsigned char) *c) ? *c : '_';
+    }
+    snprintf(path + length, size - length, ".params");
+    return true;
+}
+
+static bool load_cached_params(char const *path, char const *device, struct pcm_params *params) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    // The first line holds the device name, because the file name is not
+    // unique after sanitizing it.
+    char line[PATH_MAX];
+    bool valid = fgets(line, sizeof(line), file) && strcspn(line, "\n") == strlen(device) &&
+        strncmp(line, device, strlen(device)) == 0;
+    struct pcm_params cached;
+    valid = valid && fscanf(file, "%u %u %u %lu %lu", &cached.requested_rate_hz,
+        &cached.requested_period_time_us, &cached.rate_hz, &cached.period_size_frames,
+        &cached.buffer_size_frames) == 5;
+    fclose(file);
+    if (!valid || cached.requested_rate_hz != params->requested_rate_hz ||
+            cached.requested_period_time_us != params->requested_period_time_us) {
+        return false;
+    }
+    params->rate_hz = cached.rate_hz;
+    params->period_size_frames = cached.period_size_frames;
+    params->buffer_size_frames = cached.buffer_size_frames;
+    return true;
+}
+
+static void save_cached_params(char const *path, char const *device, struct pcm_params const *params) {
+    // Write to a temporary file first, so that concurrent instances never
+    // see a half-written cache.
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld", path, (long) getpid());
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        return;
+    }
+    fprintf(file, "%s\n%u %u %u %lu %lu\n", device, params->requested_rate_hz,
+        params->requested_period_time_us, params->rate_hz, params->period_size_frames,
+        params->buffer_size_frames);
+    if (fclose(file) != 0 || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+    }
+}
+
+// Picks mmap access if the device has it, so that looping clips can be
+// tiled straight into its buffer. Plain writes work everywhere else.
+static int set_access(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params) {
+    if (snd_pcm_hw_params_test_access(pcm, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0) {
+        return snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    }
+    return snd_pcm_hw_params_set_access(pcm, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+}
+
+// Applies previously negotiated parameters exactly, skipping all the
+// refinement that the _near functions do. Returns a negative error code if
+// the device no longer accepts them.
+static int apply_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params, struct pcm_params *params) {
+    int err;
+    if ((err = snd_pcm_hw_params_any(pcm, hw_params)) < 0 ||
+            (err = set_access(pcm, hw_params)) < 0 ||
+            (err = snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_S16)) < 0 ||
+            (err = snd_pcm_hw_params_set_channels(pcm, hw_params, 1)) < 0 ||
+            (err = snd_pcm_hw_params_set_rate(pcm, hw_params, params->rate_hz, 0)) < 0 ||
+            (err = snd_pcm_hw_params_get_buffer_size_max(hw_params, &params->max_buffer_size_frames)) < 0 ||
+            (err = snd_pcm_hw_params_set_period_size(pcm, hw_params, params->period_size_frames, 0)) < 0 ||
+            (err = snd_pcm_hw_params_set_buffer_size(pcm, hw_params, params->buffer_size_frames)) < 0) {
+        return err;
+    }
+    return snd_pcm_hw_params(pcm, hw_params);
+}
+
+// Negotiates hardware parameters as close as possible to what we want, and
+// stores the outcome in params.
+static int negotiate_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params, struct pcm_params *params,
+        FILE *log) {
+    unsigned int rate_hz = params->requested_rate_hz;
+    unsigned int period_time_us = params->requested_period_time_us;
+    unsigned int buffer_time_us = period_time_us * BUFFER_PERIODS;
+    TRY(log, snd_pcm_hw_params_any, pcm, hw_params);
+    TRY(log, set_access, pcm, hw_params);
+    TRY(log, snd_pcm_hw_params_set_format, pcm, hw_params, SND_PCM_FORMAT_S16);
+    TRY(log, snd_pcm_hw_params_set_channels, pcm, hw_params, 1);
+    TRY(log, snd_pcm_hw_params_set_rate_near, pcm, hw_params, &rate_hz, NULL);
+    // How much the buffer could grow depends on all of the above.
+    TRY(log, snd_pcm_hw_params_get_buffer_size_max, hw_params, &params->max_buffer_size_frames);
+    TRY(log, snd_pcm_hw_params_set_buffer_time_near, pcm, hw_params, &buffer_time_us, NULL);
+    TRY(log, snd_pcm_hw_params_set_period_time_near, pcm, hw_params, &period_time_us, NULL);
+    TRY(log, snd_pcm_hw_params, pcm, hw_params);
+    params->rate_hz = rate_hz;
+    TRY(log, snd_pcm_hw_params_get_period_size, hw_params, &params->period_size_frames, NULL);
+    TRY(log, snd_pcm_hw_params_get_buffer_size, hw_params, &params->buffer_size_frames);
+    return 0;
+}
+
+// Sets up the software parameters, and whether the stream will have
+// monotonic timestamps.
+static int configure_sw_params(snd_pcm_t *pcm, bool *have_timestamps, FILE *log) {
+    // Never start the stream implicitly: we fill the entire buffer first and
+    // then start it ourselves, so that the first sound comes as early as
+    // possible and playback has the whole buffer as headroom from the start.
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_sw_params_alloca(&sw_params);
+    snd_pcm_uframes_t boundary;
+    TRY(log, snd_pcm_sw_params_current, pcm, sw_params);
+    TRY(log, snd_pcm_sw_params_get_boundary, sw_params, &boundary);
+    TRY(log, snd_pcm_sw_params_set_start_threshold, pcm, sw_params, boundary);
+    // Timestamps let us report when the first frame was actually played.
+    *have_timestamps =
+        snd_pcm_sw_params_set_tstamp_mode(pcm, sw_params, SND_PCM_TSTAMP_ENABLE) >= 0 &&
+        snd_pcm_sw_params_set_tstamp_type(pcm, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC) >= 0;
+    TRY(log, snd_pcm_sw_params, pcm, sw_params);
+    return 0;
+}
+
+static double monotonic_s(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void adapt_init(struct adaptation *adapt) {
+    double now_s = monotonic_s();
+    adapt->scale = 1;
+    adapt->max_scale = ADAPT_MAX_SCALE;
+    adapt->window_start_s = now_s;
+    adapt->window_underruns = 0;
+    adapt->last_trouble_s = now_s;
+    adapt->min_headroom_frames = -1;
+}
+
+static void adapt_record_underrun(struct adaptation *adapt) {
+    double now_s = monotonic_s();
+    if (now_s - adapt->window_start_s > ADAPT_WINDOW_S) {
+        adapt->window_start_s = now_s;
+        adapt->window_underruns = 0;
+    }
+    adapt->window_underruns++;
+    adapt->last_trouble_s = now_s;
+}
+
+static void adapt_record_headroom(struct adaptation *adapt, snd_pcm_sframes_t headroom_frames) {
+    if (adapt->min_headroom_frames < 0 || headroom_frames < adapt->min_headroom_frames) {
+        adapt->min_headroom_frames = headroom_frames;
+    }
+}
+
+// Decides whether the buffer should change size, given the current
+// parameters. If so, updates the scale, writes the reason into the given
+// buffer and returns true.
+static bool adapt_decide(struct adaptation *adapt, struct pcm_params const *params, char *reason, size_t size) {
+    double now_s = monotonic_s();
+    bool can_grow = params->buffer_size_frames < params->max_buffer_size_frames && adapt->scale < adapt->max_scale;
+    bool late = adapt->min_headroom_frames >= 0 &&
+        adapt->min_headroom_frames < ADAPT_MIN_HEADROOM_PERIODS * params->period_size_frames;
+    if (late) {
+        adapt->last_trouble_s = now_s;
+    }
+
+    if (can_grow && adapt->window_underruns >= ADAPT_GROW_UNDERRUNS) {
+        snprintf(reason, size, "%u underruns in %.0f s", adapt->window_underruns,
+            now_s - adapt->window_start_s);
+        adapt->scale *= 2;
+    } else if (can_grow && late) {
+        snprintf(reason, size, "only %.1f ms of audio left at the start of a write",
+            adapt->min_headroom_frames * 1e3 / params->rate_hz);
+        adapt->scale *= 2;
+    } else if (adapt->scale > 1 && now_s - adapt->last_trouble_s > ADAPT_SHRINK_AFTER_S) {
+        snprintf(reason, size, "no trouble for %.0f s", now_s - adapt->last_trouble_s);
+        adapt->scale /= 2;
+    } else {
+        // Judge every write on its own, so that one late write doesn't keep
+        // the buffer from shrinking forever.
+        adapt->min_headroom_frames = -1;
+        return false;
+    }
+    adapt->window_start_s = now_s;
+    adapt->window_underruns = 0;
+    adapt->last_trouble_s = now_s;
+    adapt->min_headroom_frames = -1;
+    return true;
+}
+
+// Returns the CLOCK_MONOTONIC time at which this process was exec'ed, to the
+// resolution of the kernel's clock ticks.
+static bool get_exec_time(struct timespec *exec_time) {
+    FILE *file = fopen("/proc/self/stat", "r");
+    if (!file) {
+        return false;
+    }
+    char stat[1024];
+    size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[length] = '\0';
+    // The process name is in parentheses and may contain spaces, so start
+    // counting fields after the closing one. The start time is field 22.
+    char const *field = strrchr(stat, ')');
+    if (!field) {
+        return false;
+    }
+    for (int i = 2; i < 22 && field; i++) {
+        field = strchr(field + 1, ' ');
+    }
+    if (!field) {
+        return false;
+    }
+    double start_s = strtoull(field + 1, NULL, 10) / (double) sysconf(_SC_CLK_TCK);
+
+    // The start time is measured on CLOCK_BOOTTIME, which differs from
+    // CLOCK_MONOTONIC by the time spent in suspend.
+    struct timespec boot_now, monotonic_now;
+    clock_gettime(CLOCK_BOOTTIME, &boot_now);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+    double boot_now_s = boot_now.tv_sec + boot_now.tv_nsec * 1e-9;
+    double monotonic_s = monotonic_now.tv_sec + monotonic_now.tv_nsec * 1e-9 - (boot_now_s - start_s);
+    exec_time->tv_sec = monotonic_s;
+    exec_time->tv_nsec = (monotonic_s - exec_time->tv_sec) * 1e9;
+    return true;
+}
+
+static snd_pcm_sframes_t output_writei(struct output *out, void const *buffer, snd_pcm_uframes_t frames) {
+    if (out->raw) {
+        return piep_raw_writei(out->raw, buffer, frames);
+    }
+    return out->mmap ? snd_pcm_mmap_writei(out->pcm, buffer, frames) : snd_pcm_writei(out->pcm, buffer, frames);
+}
+
+// Fills dest with frames from the clip, looping it from the given offset.
+static void tile_clip(sample *dest, snd_pcm_uframes_t frames, sample const *clip, unsigned int clip_size_frames,
+        unsigned int clip_offset_frames) {
+    while (frames > 0) {
+        snd_pcm_uframes_t count = clip_size_frames - clip_offset_frames;
+        if (count > frames) {
+            count = frames;
+        }
+        memcpy(dest, clip + clip_offset_frames, count * sizeof(sample));
+        dest += count;
+        frames -= count;
+        clip_offset_frames = 0;
+    }
+}
+
+// Writes frames from the clip, looping it as often as needed, starting at the
+// given offset into it. This lets the clip be as short as its repeating unit,
+// however large the periods are: where possible, it is copied straight into
+// the device's buffer. Returns the number of frames written, or a negative
+// error code, which is -EAGAIN if the buffer is full.
+static snd_pcm_sframes_t output_write_clip(struct output *out, sample const *clip, unsigned int clip_size_frames,
+        unsigned int clip_offset_frames, snd_pcm_uframes_t frames) {
+    if (out->raw) {
+        return piep_raw_write_looped(out->raw, clip, clip_size_frames, clip_offset_frames, frames);
+    }
+    snd_pcm_uframes_t written = 0;
+    while (written < frames) {
+        snd_pcm_uframes_t count = frames - written;
+        snd_pcm_sframes_t result;
+        if (out->mmap) {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(out->pcm);
+            if (avail == 0) {
+                result = -EAGAIN;
+            } else if (avail < 0) {
+                result = avail;
+            } else {
+                snd_pcm_channel_area_t const *areas;
+                snd_pcm_uframes_t offset;
+                if (count > (snd_pcm_uframes_t) avail) {
+                    count = avail;
+                }
+                result = snd_pcm_mmap_begin(out->pcm, &areas, &offset, &count);
+                if (result >= 0) {
+                    sample *dest = (sample *) ((char *) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8);
+                    tile_clip(dest, count, clip, clip_size_frames, clip_offset_frames);
+                    result = snd_pcm_mmap_commit(out->pcm, offset, count);
+                }
+            }
+        } else if (count <= clip_size_frames - clip_offset_frames) {
+            result = snd_pcm_writei(out->pcm, clip + clip_offset_frames, count);
+        } else {
+            // The write wraps around the end of the clip, so tile it into
+            // the scratch buffer and write that in one go, or as much of it
+            // as fits.
+            if (count > out->scratch_size_frames) {
+                count = out->scratch_size_frames;
+            }
+            tile_clip(out->scratch, count, clip, clip_size_frames, clip_offset_frames);
+            result = snd_pcm_writei(out->pcm, out->scratch, count);
+        }
+        if (result < 0) {
+            return written > 0 ? (snd_pcm_sframes_t) written : result;
+        }
+        written += result;
+        clip_offset_frames = (clip_offset_frames + result) % clip_size_frames;
+        if ((snd_pcm_uframes_t) result < count) {
+            break;
+        }
+    }
+    return written;
+}
+
+static snd_pcm_sframes_t output_avail(struct output *out) {
+    return out->raw ? piep_raw_avail(out->raw) : snd_pcm_avail(out->pcm);
+}
+
+static int output_prepare(struct output *out) {
+    return out->raw ? piep_raw_prepare(out->raw) : snd_pcm_prepare(out->pcm);
+}
+
+static int output_start(struct output *out) {
+    return out->raw ? piep_raw_start(out->raw) : snd_pcm_start(out->pcm);
+}
+
+static int output_drop(struct output *out) {
+    return out->raw ? piep_raw_drop(out->raw) : snd_pcm_drop(out->pcm);
+}
+
+static int output_resume(struct output *out) {
+    return out->raw ? piep_raw_resume(out->raw) : snd_pcm_resume(out->pcm);
+}
+
+static void output_close(struct output *out) {
+    if (out->raw) {
+        piep_raw_close(out->raw);
+    } else if (out->pcm) {
+        snd_pcm_close(out->pcm);
+    }
+    out->raw = NULL;
+    out->pcm = NULL;
+    free(out->scratch);
+    out->scratch = NULL;
+    out->scratch_size_frames = 0;
+}
+
+static bool output_has_mmap(snd_pcm_hw_params_t const *hw_params) {
+    snd_pcm_access_t access;
+    return snd_pcm_hw_params_get_access(hw_params, &access) >= 0 && access == SND_PCM_ACCESS_MMAP_INTERLEAVED;
+}
+
+// Reports that there was not enough memory for something, and returns the
+// error code for it.
+static int out_of_memory(FILE *log, char const *what) {
+    if (log) {
+        fprintf(log, "Out of memory for %s\n", what);
+    }
+    return -ENOMEM;
+}
+
+// Sizes the buffer that RW writes tile the clip into where it wraps around,
+// once per negotiation, so that writing never has to allocate. Memory-mapped
+// writes tile straight into the device's buffer and need none.
+static int output_alloc_scratch(struct output *out, snd_pcm_uframes_t period_size_frames, FILE *log) {
+    free(out->scratch);
+    out->scratch = NULL;
+    out->scratch_size_frames = 0;
+    if (out->mmap) {
+        return 0;
+    }
+    out->scratch = malloc(period_size_frames * sizeof(sample));
+    if (!out->scratch) {
+        return out_of_memory(log, "the write buffer");
+    }
+    out->scratch_size_frames = period_size_frames;
+    return 0;
+}
+
+// Negotiates parameters from scratch and sets up the software parameters,
+// and whether the stream will have monotonic timestamps.
+static int output_negotiate(struct output *out, snd_pcm_hw_params_t *hw_params, struct pcm_params *params,
+        bool *have_timestamps, FILE *log) {
+    if (out->raw) {
+        params->rate_hz = params->requested_rate_hz;
+        TRY(log, piep_raw_negotiate, out->raw, 1, &params->rate_hz, params->requested_period_time_us,
+            params->requested_period_time_us * BUFFER_PERIODS, &params->period_size_frames,
+            &params->buffer_size_frames, &params->max_buffer_size_frames);
+        *have_timestamps = true;
+        return 0;
+    }
+    int err = negotiate_params(out->pcm, hw_params, params, log);
+    if (err < 0) {
+        return err;
+    }
+    out->mmap = output_has_mmap(hw_params);
+    err = output_alloc_scratch(out, params->period_size_frames, log);
+    if (err < 0) {
+        return err;
+    }
+    return configure_sw_params(out->pcm, have_timestamps, log);
+}
+
+// Reports how long it took from exec to playing the first frame, according to
+// the trigger timestamp of the stream.
+static void report_first_frame(struct output *out, FILE *log) {
+    struct timespec exec_time;
+    if (!get_exec_time(&exec_time)) {
+        return;
+    }
+    struct timespec trigger;
+    if (out->raw) {
+        if (piep_raw_trigger_time(out->raw, &trigger) < 0) {
+            return;
+        }
+    } else {
+        snd_pcm_status_t *status;
+        snd_pcm_status_alloca(&status);
+        if (snd_pcm_status(out->pcm, status) < 0) {
+            return;
+        }
+        snd_pcm_status_get_trigger_htstamp(status, &trigger);
+    }
+    double delay_ms = (trigger.tv_sec - exec_time.tv_sec) * 1e3 + (trigger.tv_nsec - exec_time.tv_nsec) * 1e-6;
+    fprintf(log, "First frame played %.1f ms after exec\n", delay_ms);
+}
+
+// Tones and sweeps must stay strictly between DC and the Nyquist frequency.
+static bool frequency_valid(float frequency_hz, unsigned int rate_hz) {
+    return frequency_hz > 0.0f && frequency_hz < 0.5f * rate_hz;
+}
+
+// Checks the frequencies in the configuration against the rate they will be
+// played at. Files have no frequency to check.
+static int check_frequencies(struct piep_config const *config, unsigned int rate_hz) {
+    if (config->input_path) {
+        return 0;
+    }
+    float frequencies_hz[] = { config->frequency_hz, config->end_frequency_hz };
+    unsigned int count = config->sweep != PIEP_SWEEP_NONE ? 2 : 1;
+    for (unsigned int i = 0; i < count; i++) {
+        if (!frequency_valid(frequencies_hz[i], rate_hz)) {
+            if (config->log) {
+                fprintf(config->log, "Frequency %f Hz is not between 0 and %u Hz, half the sample rate\n",
+                    frequencies_hz[i], rate_hz / 2);
+            }
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// Returns the number of whole waves in a clip of the given size that comes
+// closest to the given frequency.
+static unsigned int waves_per_clip(double frequency_hz, unsigned int rate_hz, unsigned int clip_size_frames) {
+    unsigned int waves = round(frequency_hz * clip_size_frames / rate_hz);
+    return waves > 0 ? waves : 1;
+}
+
+static double clip_frequency_error(double frequency_hz, unsigned int rate_hz, unsigned int clip_size_frames) {
+    double clip_frequency_hz = (double) waves_per_clip(frequency_hz, rate_hz, clip_size_frames) *
+        rate_hz / clip_size_frames;
+    return fabs(clip_frequency_hz - frequency_hz);
+}
+
+// Generates a clip of a tone or noise, and reports what it made on the given
+// log, if any. Returns the newly allocated clip, or NULL if there is no memory
+// for it.
+static sample *generate_clip(enum piep_waveform waveform, float frequency_hz, float amplitude,
+        unsigned int rate_hz, FILE *verbose_log, unsigned int *clip_size_frames) {
+    if (is_noise(waveform)) {
+        // Noise needs to be long to avoid audible repetition. Any length will
+        // do, because writes loop the clip wherever it ends.
+        *clip_size_frames = NOISE_LOOP_TIME_S * rate_hz;
+        sample *clip = malloc(*clip_size_frames * sizeof(sample));
+        if (clip && fill_noise_clip(clip, *clip_size_frames, waveform, amplitude) < 0) {
+            free(clip);
+            clip = NULL;
+        }
+        return clip;
+    }
+
+    // A tone only needs its repeating unit: a clip that holds a whole number
+    // of waves. Writes loop it to fill periods of any size, so neither its
+    // accuracy nor its memory depends on the buffer geometry. Pick the
+    // shortest clip that comes closest to the frequency.
+    unsigned int max_size_frames = TONE_MAX_CLIP_TIME_S * rate_hz;
+    double best_error_hz = INFINITY;
+    for (unsigned int size_frames = 1; size_frames <= max_size_frames; size_frames++) {
+        double error_hz = clip_frequency_error(frequency_hz, rate_hz, size_frames);
+        if (error_hz < best_error_hz - 1e-9) {
+            best_error_hz = error_hz;
+            *clip_size_frames = size_frames;
+        }
+    }
+    unsigned int waves = waves_per_clip(frequency_hz, rate_hz, *clip_size_frames);
+    frequency_hz = (double) waves * rate_hz / *clip_size_frames;
+    if (verbose_log) {
+        fprintf(verbose_log, "Using rounded frequency %f Hz, %u waves in %u frames\n",
+            frequency_hz, waves, *clip_size_frames);
+    }
+
+    // Only the mipmap level that fits our frequency is ever needed.
+    sample *clip = malloc(*clip_size_frames * sizeof(sample));
+    float *table = malloc(WAVETABLE_SIZE * sizeof(float));
+    if (!clip || !table || wavetable_fill(table, waveform, wavetable_level(frequency_hz, rate_hz)) < 0) {
+        free(clip);
+        free(table);
+        return NULL;
+    }
+    fill_wavetable_clip(clip, *clip_size_frames, table, waves, amplitude);
+    free(table);
+    return clip;
+}
+
+// Opens the device and sets it up, reusing the outcome of the previous
+// negotiation with it if we can, because negotiation can be slow on complex
+// plugin chains. The raw backend's negotiation is just a handful of ioctls,
+// so it needs no cache. Also sets whether the stream will have monotonic
+// timestamps. On failure, the device may be left open.
+static int output_open(struct output *out, snd_pcm_hw_params_t *hw_params, struct pcm_params *params,
+        char const *device, bool raw, bool *have_timestamps, FILE *log, bool verbose) {
+    FILE *verbose_log = verbose ? log : NULL;
+    if (raw) {
+        int err = piep_raw_open(&out->raw, device);
+        if (err < 0) {
+            if (err != -EBUSY) {
+                REPORT(log, piep_raw_open, err);
+            }
+            return err;
+        }
+        err = output_negotiate(out, hw_params, params, have_timestamps, log);
+        if (err == 0 && verbose_log) {
+            piep_raw_dump(out->raw, verbose_log);
+        }
+        return err;
+    }
+
+    // Writes must never block, or they would hold up the program's event
+    // loop. Neither does opening: a busy device fails with -EBUSY, which is
+    // not worth a report, since the caller may simply try again later.
+    int err = snd_pcm_open(&out->pcm, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+    if (err < 0) {
+        if (err != -EBUSY) {
+            REPORT(log, snd_pcm_open, err);
+        }
+        return err;
+    }
+
+    if (verbose_log) {
+        snd_output_t *output;
+        TRY(log, snd_output_stdio_attach, &output, verbose_log, 0);
+        snd_pcm_dump(out->pcm, output);
+        snd_output_close(output);
+    }
+
+    char cache_path[PATH_MAX];
+    bool have_cache_path = params_cache_path(cache_path, sizeof(cache_path), device);
+    if (have_cache_path && load_cached_params(cache_path, device, params)) {
+        err = apply_params(out->pcm, hw_params, params);
+        if (err < 0) {
+            if (verbose_log) {
+                fprintf(verbose_log, "Cached parameters in %s no longer apply: %s\n",
+                    cache_path, snd_strerror(err));
+            }
+            err = negotiate_params(out->pcm, hw_params, params, log);
+            if (err == 0) {
+                save_cached_params(cache_path, device, params);
+            }
+        } else if (verbose_log) {
+            fprintf(verbose_log, "Using cached parameters from %s\n", cache_path);
+        }
+    } else {
+        err = negotiate_params(out->pcm, hw_params, params, log);
+        if (err == 0 && have_cache_path) {
+            save_cached_params(cache_path, device, params);
+        }
+    }
+    if (err < 0) {
+        return err;
+    }
+    out->mmap = output_has_mmap(hw_params);
+    err = output_alloc_scratch(out, params->period_size_frames, log);
+    if (err < 0) {
+        return err;
+    }
+    return configure_sw_params(out->pcm, have_timestamps, log);
+}
+
+// The number of frames the sweep ring must hold, so that it can fill the
+// whole buffer and still be a period ahead.
+static size_t ring_size_for(struct pcm_params const *params) {
+    return params->buffer_size_frames + params->period_size_frames;
+}
+
+// The sweep ring must follow the buffer size. What it held is lost, but so is
+// the device's buffer anyway. Clips loop regardless of the period size.
+static int resize_for_period(struct piep *piep) {
+    struct sweep_producer *producer = piep->producer;
+    size_t min_size_frames = ring_size_for(&piep->params);
+    if (producer && (producer->ring.size_frames < min_size_frames ||
+            producer->ring.size_frames >= 2 * min_size_frames)) {
+        stop_producer(piep);
+        int err = ring_resize(&producer->ring, min_size_frames);
+        if (err < 0) {
+            out_of_memory(piep->config.log, "the sweep");
+        }
+        sweep_produce(producer);
+        int start_err = start_producer(piep);
+        return err < 0 ? err : start_err;
+    }
+    return 0;
+}
+
+// Sets up what to play, now that the rate and period size are known.
+static int prepare_source(struct piep *piep) {
+    struct piep_config const *config = &piep->config;
+    unsigned int rate_hz = piep->params.rate_hz;
+
+    if (config->sweep != PIEP_SWEEP_NONE) {
+        struct sweep_producer *producer = piep->producer = calloc(1, sizeof(struct sweep_producer));
+        if (!producer) {
+            return out_of_memory(config->log, "the sweep");
+        }
+        sweep_init(&producer->sweep, config, rate_hz);
+        // Synthesis runs on its own thread, so that it can never hold up the
+        // writes. The ring holds the whole buffer and a period more, and we
+        // fill it before starting, so that the pre-roll never has to wait
+        // for the producer.
+        piep->silence = calloc(SILENCE_FRAMES, sizeof(sample));
+        if (ring_init(&producer->ring, ring_size_for(&piep->params)) < 0 || !piep->silence) {
+            return out_of_memory(config->log, "the sweep");
+        }
+        sweep_produce(producer);
+        int err = start_producer(piep);
+        if (err < 0) {
+            return err;
+        }
+        if (piep->verbose_log) {
+            fprintf(piep->verbose_log, "Sweeping from %f Hz to %f Hz in %f s\n",
+                config->frequency_hz, config->end_frequency_hz, config->sweep_time_s);
+        }
+    } else if (config->input_path) {
+        if (wav_matches_pcm(&piep->wav, rate_hz)) {
+            // Play straight from the mapped pages. Tell the kernel we'll want
+            // them, so that the first loop doesn't stall on page faults.
+            piep->clip = (sample const *) piep->wav.data;
+            piep->clip_size_frames = piep->wav.num_frames;
+            madvise(piep->wav.map, piep->wav.map_size, MADV_WILLNEED);
+            if (piep->verbose_log) {
+                fprintf(piep->verbose_log, "Playing file data directly\n");
+            }
+        } else {
+            piep->clip = piep->converted_clip = wav_convert(&piep->wav, rate_hz, &piep->clip_size_frames);
+            if (!piep->clip) {
+                return out_of_memory(config->log, config->input_path);
+            }
+            munmap(piep->wav.map, piep->wav.map_size);
+            piep->wav_mapped = false;
+            if (piep->verbose_log) {
+                fprintf(piep->verbose_log, "Converted file to %u frames of mono S16 at %u Hz\n",
+                    piep->clip_size_frames, rate_hz);
+            }
+        }
+    } else {
+        piep->clip = piep->generated_clip = generate_clip(config->waveform, config->frequency_hz,
+            config->amplitude, rate_hz, piep->verbose_log, &piep->clip_size_frames);
+        if (!piep->clip) {
+            return out_of_memory(config->log, "the tone");
+        }
+    }
+    return 0;
+}
+
+void piep_config_init(struct piep_config *config) {
+    *config = (struct piep_config) {
+        .device = "default",
+        .waveform = PIEP_WAVEFORM_SINE,
+        .frequency_hz = 440.0f,
+        .amplitude = 1.0f,
+        .sweep = PIEP_SWEEP_NONE,
+        .end_frequency_hz = 1000.0f,
+        .sweep_time_s = 10.0f,
+    };
+}
+
+int piep_open(struct piep **piep_out, struct piep_config const *config) {
+    struct piep *piep = calloc(1, sizeof(struct piep));
+    if (!piep) {
+        return -ENOMEM;
+    }
+    piep->config = *config;
+    piep->verbose_log = config->verbose ? config->log : NULL;
+    FILE *log = config->log;
+
+    int err = snd_pcm_hw_params_malloc(&piep->hw_params);
+    if (err < 0) {
+        REPORT(log, snd_pcm_hw_params_malloc, err);
+        piep_close(piep);
+        return err;
+    }
+
+    unsigned int rate_hz = config->rate_hz ? config->rate_hz : DEFAULT_RATE_HZ;
+    if (config->input_path) {
+        err = wav_map(config->input_path, &piep->wav, log);
+        if (err < 0) {
+            piep_close(piep);
+            return err;
+        }
+        piep->wav_mapped = true;
+        if (!config->rate_hz) {
+            rate_hz = piep->wav.rate_hz;
+        }
+        if (piep->verbose_log) {
+            fprintf(piep->verbose_log, "Loaded %s: format %u, %u channels, %u Hz, %u bits, %zu frames\n",
+                config->input_path, piep->wav.format_tag, piep->wav.channels, piep->wav.rate_hz,
+                piep->wav.bits_per_sample, piep->wav.num_frames);
+        }
+    }
+
+    piep->params = (struct pcm_params) {
+        .requested_rate_hz = rate_hz,
+        .requested_period_time_us = PERIOD_TIME_US,
+    };
+    err = output_open(&piep->out, piep->hw_params, &piep->params, config->device, config->raw,
+        &piep->have_timestamps, log, config->verbose);
+    if (err == 0) {
+        if (piep->verbose_log) {
+            fprintf(piep->verbose_log, "Using sample rate %u Hz, buffer size %lu frames, period size %lu frames\n",
+                piep->params.rate_hz, piep->params.buffer_size_frames, piep->params.period_size_frames);
+        }
+        // The device may not have given us the rate we asked for.
+        err = check_frequencies(config, piep->params.rate_hz);
+    }
+    if (err == 0) {
+        err = prepare_source(piep);
+    }
+    if (err < 0) {
+        piep_close(piep);
+        return err;
+    }
+    adapt_init(&piep->adapt);
+    *piep_out = piep;
+    return 0;
+}
+
+void piep_close(struct piep *piep) {
+    if (!piep) {
+        return;
+    }
+    output_close(&piep->out);
+    if (piep->producer) {
+        stop_producer(piep);
+        sem_destroy(&piep->producer->ring.space);
+        free(piep->producer->ring.buffer);
+        free(piep->producer);
+    }
+    free(piep->silence);
+    free(piep->generated_clip);
+    free(piep->converted_clip);
+    if (piep->wav_mapped) {
+        munmap(piep->wav.map, piep->wav.map_size);
+    }
+    if (piep->hw_params) {
+        snd_pcm_hw_params_free(piep->hw_params);
+    }
+    free(piep);
+}
+
+static bool output_is_open(struct output const *out) {
+    return out->pcm || out->raw;
+}
+
+void piep_stop(struct piep *piep) {
+    output_close(&piep->out);
+}
+
+int piep_start(struct piep *piep) {
+    if (output_is_open(&piep->out)) {
+        return 0;
+    }
+    // Start over with the initial buffer size, which is in the cache.
+    piep->params.requested_period_time_us = PERIOD_TIME_US;
+    int err = output_open(&piep->out, piep->hw_params, &piep->params, piep->config.device, piep->config.raw,
+        &piep->have_timestamps, piep->config.log, piep->config.verbose);
+    if (err < 0) {
+        output_close(&piep->out);
+        return err;
+    }
+    adapt_init(&piep->adapt);
+    piep->preroll_frames = 0;
+    return resize_for_period(piep);
+}
+
+int piep_poll_descriptors_count(struct piep *piep) {
+    if (piep->out.raw) {
+        return 1;
+    }
+    return piep->out.pcm ? snd_pcm_poll_descriptors_count(piep->out.pcm) : 0;
+}
+
+int piep_poll_descriptors(struct piep *piep, struct pollfd *fds, unsigned int space) {
+    if (piep->out.raw) {
+        if (space < 1) {
+            return 0;
+        }
+        fds[0] = (struct pollfd) { .fd = piep_raw_poll_descriptor(piep->out.raw), .events = POLLOUT };
+        return 1;
+    }
+    return piep->out.pcm ? snd_pcm_poll_descriptors(piep->out.pcm, fds, space) : 0;
+}
+
+// Drops the stream and negotiates again with the period time that the
+// adaptation asks for. The rate was requested the same way as before, so it
+// will not change.
+static int renegotiate(struct piep *piep, char const *reason) {
+    FILE *log = piep->config.log;
+    snd_pcm_uframes_t old_buffer_size_frames = piep->params.buffer_size_frames;
+    unsigned int old_period_time_us = piep->params.requested_period_time_us;
+    TRY(log, output_drop, &piep->out);
+    piep->params.requested_period_time_us = PERIOD_TIME_US * piep->adapt.scale;
+    int err = output_negotiate(&piep->out, piep->hw_params, &piep->params, &piep->have_timestamps, log);
+    if (err < 0) {
+        return err;
+    }
+    if (piep->params.requested_period_time_us > old_period_time_us &&
+            piep->params.buffer_size_frames <= old_buffer_size_frames) {
+        // The device would not go any further, whatever its maximum claims.
+        // Stay where we were, and don't try again.
+        piep->adapt.scale /= 2;
+        piep->adapt.max_scale = piep->adapt.scale;
+        piep->params.requested_period_time_us = old_period_time_us;
+        if (log) {
+            fprintf(log, "Buffer size stays at %lu frames, the most the device allows: %s\n",
+                piep->params.buffer_size_frames, reason);
+        }
+    } else if (log) {
+        fprintf(log, "Changed buffer size from %lu to %lu frames (period size %lu frames): %s\n",
+            old_buffer_size_frames, piep->params.buffer_size_frames, piep->params.period_size_frames, reason);
+    }
+    piep->preroll_frames = 0;
+    return resize_for_period(piep);
+}
+
+// Writes up to a period, and deals with whatever went wrong. Returns -EAGAIN
+// once the device is full.
+static int write_period(struct piep *piep) {
+    FILE *log = piep->config.log;
+    struct output *out = &piep->out;
+    snd_pcm_uframes_t period_size_frames = piep->params.period_size_frames;
+    snd_pcm_uframes_t buffer_size_frames = piep->params.buffer_size_frames;
+
+    // Measure how close we came to running out, unless the stream is
+    // stopped anyway.
+    if (piep->preroll_frames >= buffer_size_frames) {
+        snd_pcm_sframes_t available = output_avail(out);
+        if (available >= 0) {
+            adapt_record_headroom(&piep->adapt, buffer_size_frames - available);
+        }
+    }
+
+    char reason[128];
+    if (adapt_decide(&piep->adapt, &piep->params, reason, sizeof(reason))) {
+        return renegotiate(piep, reason);
+    }
+
+    sample const *data = NULL;
+    snd_pcm_uframes_t frames = period_size_frames;
+    if (piep->preroll_frames < buffer_size_frames && frames > buffer_size_frames - piep->preroll_frames) {
+        frames = buffer_size_frames - piep->preroll_frames;
+    }
+    if (piep->producer) {
+        snd_pcm_uframes_t available = ring_read_space(&piep->producer->ring, &data);
+        if (available == 0) {
+            // The synthesis thread fell behind. Rather than waiting for it
+            // and risking an underrun, play a little silence.
+            data = piep->silence;
+            if (frames > SILENCE_FRAMES) {
+                frames = SILENCE_FRAMES;
+            }
+        } else if (frames > available) {
+            frames = available;
+        }
+    }
+    snd_pcm_sframes_t result = piep->producer ? output_writei(out, data, frames) :
+        output_write_clip(out, piep->clip, piep->clip_size_frames, piep->clip_offset_frames, frames);
+    if (result == -EAGAIN || result == -EINTR) {
+        return -EAGAIN;
+    } else if (result == -EPIPE) {
+        // Buffer underrun.
+        piep->stats.underruns++;
+        adapt_record_underrun(&piep->adapt);
+        if (piep->verbose_log) {
+            fprintf(piep->verbose_log, "Buffer underrun\n");
+        }
+        TRY(log, output_prepare, out);
+        piep->preroll_frames = 0;
+        return 0;
+    } else if (result == -ESTRPIPE) {
+        // Stream suspended. If the device is still waking up, rather than
+        // wait for it, or if it can't resume at all, start over as after an
+        // underrun.
+        piep->stats.suspends++;
+        int err = output_resume(out);
+        if (err < 0 && err != -EAGAIN && err != -ENOSYS) {
+            REPORT(log, output_resume, err);
+            return err;
+        }
+        TRY(log, output_prepare, out);
+        piep->preroll_frames = 0;
+        return 0;
+    } else if (result < 0) {
+        REPORT(log, output_writei, result);
+        return result;
+    }
+
+    piep->stats.frames_written += result;
+    if (piep->producer) {
+        if (data == piep->silence) {
+            piep->stats.ring_underruns++;
+        } else {
+            ring_consume(&piep->producer->ring, result);
+        }
+    } else {
+        piep->clip_offset_frames = (piep->clip_offset_frames + result) % piep->clip_size_frames;
+    }
+
+    if (piep->preroll_frames < buffer_size_frames) {
+        piep->preroll_frames += result;
+        if (piep->preroll_frames >= buffer_size_frames) {
+            TRY(log, output_start, out);
+            if (!piep->started_once && piep->verbose_log && piep->have_timestamps) {
+                report_first_frame(out, piep->verbose_log);
+            }
+            piep->started_once = true;
+        }
+    }
+    return 0;
+}
+
+int piep_handle_events(struct piep *piep, struct pollfd *fds, unsigned int nfds) {
+    if (!output_is_open(&piep->out)) {
+        return 0;
+    }
+    unsigned short revents = 0;
+    if (piep->out.raw) {
+        for (unsigned int i = 0; i < nfds; i++) {
+            revents |= fds[i].revents;
+        }
+    } else {
+        TRY(piep->config.log, snd_pcm_poll_descriptors_revents, piep->out.pcm, fds, nfds, &revents);
+    }
+    if (!(revents & (POLLOUT | POLLERR))) {
+        return 0;
+    }
+    // Errors show up as POLLERR, and writing is what tells us which one it
+    // was, so write in either case until the device is full.
+    while (true) {
+        int err = write_period(piep);
+        if (err == -EAGAIN) {
+            return 0;
+        } else if (err < 0) {
+            return err;
+        }
+    }
+}
+
+int piep_set_tone(struct piep *piep, enum piep_waveform waveform, float frequency_hz, float amplitude) {
+    if (!piep->generated_clip || waveform >= PIEP_WAVEFORM_COUNT ||
+            !frequency_valid(frequency_hz, piep->params.rate_hz) || amplitude < 0.0f || amplitude > 1.0f) {
+        return -EINVAL;
+    }
+    // Keep playing the old tone if there is no memory for the new one.
+    unsigned int clip_size_frames;
+    sample *clip = generate_clip(waveform, frequency_hz, amplitude, piep->params.rate_hz, piep->verbose_log,
+        &clip_size_frames);
+    if (!clip) {
+        return -ENOMEM;
+    }
+    free(piep->generated_clip);
+    piep->clip = piep->generated_clip = clip;
+    piep->clip_size_frames = clip_size_frames;
+    piep->clip_offset_frames = 0;
+    piep->config.waveform = waveform;
+    piep->config.frequency_hz = frequency_hz;
+    piep->config.amplitude = amplitude;
+    return 0;
+}
+
+void piep_get_stats(struct piep *piep, struct piep_stats *stats) {
+    *stats = piep->stats;
+    stats->rate_hz = piep->params.rate_hz;
+    stats->period_size_frames = piep->params.period_size_frames;
+    stats->buffer_size_frames = piep->params.buffer_size_frames;
+}
+
+void piep_prefault(struct piep *piep) {
+    if (piep->clip) {
+        prefault(piep->clip, piep->clip_size_frames * sizeof(sample));
+    }
+    if (piep->producer) {
+        prefault(piep->producer->ring.buffer, piep->producer->ring.size_frames * sizeof(sample));
+        prefault(piep->silence, SILENCE_FRAMES * sizeof(sample));
+    }
+    if (piep->out.scratch) {
+        prefault(piep->out.scratch, piep->out.scratch_size_frames * sizeof(sample));
+    }
+}
+
+
+int piep_open_output(struct piep **piep_out, struct piep_config const *config, snd_pcm_t *pcm, bool mmap,
+        struct raw_pcm *raw, unsigned int rate_hz, snd_pcm_uframes_t period_size_frames,
+        snd_pcm_uframes_t buffer_size_frames) {
+    struct piep *piep = calloc(1, sizeof(struct piep));
+    if (!piep) {
+        struct output out = { .pcm = pcm, .raw = raw };
+        output_close(&out);
+        return -ENOMEM;
+    }
+    piep->config = *config;
+    piep->verbose_log = config->verbose ? config->log : NULL;
+    piep->out = (struct output) { .pcm = pcm, .raw = raw, .mmap = mmap };
+    piep->params = (struct pcm_params) {
+        .requested_rate_hz = rate_hz,
+        .requested_period_time_us = PERIOD_TIME_US,
+        .rate_hz = rate_hz,
+        .period_size_frames = period_size_frames,
+        .buffer_size_frames = buffer_size_frames,
+        .max_buffer_size_frames = buffer_size_frames,
+    };
+    int err = check_frequencies(config, rate_hz);
+    if (err == 0 && pcm) {
+        err = output_alloc_scratch(&piep->out, period_size_frames, config->log);
+    }
+    if (err == 0 && pcm) {
+        err = configure_sw_params(pcm, &piep->have_timestamps, config->log);
+    }
+    if (err == 0) {
+        err = prepare_source(piep);
+    }
+    if (err < 0) {
+        piep_close(piep);
+        return err;
+    }
+    adapt_init(&piep->adapt);
+    *piep_out = piep;
+    return 0;
+}
+
+int piep_write_period(struct piep *piep) {
+    return write_period(piep);
+}
+
+void piep_wait_for_producer(struct piep *piep) {
+    if (!piep->producer) {
+        return;
+    }
+    struct ring *ring = &piep->producer->ring;
+    struct timespec pause = { .tv_nsec = 100000 };
+    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail < piep->params.buffer_size_frames) {
+        nanosleep(&pause, NULL);
+    }
+}
+
+void piep_get_source(struct piep const *piep, struct piep_source *source) {
+    unsigned int rate_hz = piep->params.rate_hz;
+    *source = (struct piep_source) { .clip = piep->clip, .clip_size_frames = piep->clip_size_frames };
+    if (piep->producer) {
+        struct sweep const *sweep = &piep->producer->sweep;
+        source->sweep_size_frames = (size_t) ceilf(sweep->duration_s * rate_hz / SWEEP_BLOCK_FRAMES) *
+            SWEEP_BLOCK_FRAMES;
+    } else if (piep->generated_clip && !is_noise(piep->config.waveform)) {
+        unsigned int waves = waves_per_clip(piep->config.frequency_hz, rate_hz, piep->clip_size_frames);
+        source->frequency_hz = (double) waves * rate_hz / piep->clip_size_frames;
+        source->num_harmonics = WAVETABLE_SIZE / 4 >> wavetable_level(source->frequency_hz, rate_hz);
+    }
+}
+
+void piep_render_source(struct piep const *piep, int16_t *buffer, size_t frames) {
+    if (piep->producer) {
+        struct sweep sweep;
+        sweep_init(&sweep, &piep->config, piep->params.rate_hz);
+        sweep_fill(&sweep, buffer, frames);
+    } else {
+        tile_clip(buffer, frames, piep->clip, piep->clip_size_frames, 0);
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef LIBPIEP_H
+#define LIBPIEP_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The engine behind piep, for programs that want to play its tones from their
+// own event loop. Nothing in here blocks: the caller polls the descriptors
+// that the engine hands out and calls piep_handle_events when they fire. The
+// engine takes care of negotiation, synthesis and recovery from underruns and
+// suspends.
+//
+// Functions that can fail return a negative errno value, which snd_strerror
+// can describe.
+
+enum piep_waveform {
+    PIEP_WAVEFORM_SINE,
+    PIEP_WAVEFORM_SQUARE,
+    PIEP_WAVEFORM_TRIANGLE,
+    PIEP_WAVEFORM_SAW,
+    PIEP_WAVEFORM_WHITE,
+    PIEP_WAVEFORM_PINK,
+    PIEP_WAVEFORM_COUNT
+};
+
+// Names of the waveforms, for parsing and printing them.
+extern char const *const piep_waveform_names[PIEP_WAVEFORM_COUNT];
+
+enum piep_sweep {
+    PIEP_SWEEP_NONE,
+    PIEP_SWEEP_LINEAR,
+    PIEP_SWEEP_LOGARITHMIC,
+};
+
+// What to play and where. Strings must stay valid while the engine is open.
+struct piep_config {
+    // ALSA device name, or for the raw backend hw:CARD[,DEVICE] or a path
+    // under /dev/snd.
+    char const *device;
+    // Bypass alsa-lib and drive the kernel's PCM interface directly.
+    bool raw;
+    // Requested sample rate, or 0 for that of the input file, if any, or
+    // 44100 Hz.
+    unsigned int rate_hz;
+    enum piep_waveform waveform;
+    // Frequencies must lie strictly between 0 and half the sample rate, or
+    // piep_open fails with -EINVAL.
+    float frequency_hz;
+    float amplitude;
+    // Sweeps go from frequency_hz to end_frequency_hz in sweep_time_s, and
+    // then start over. They ignore the waveform.
+    enum piep_sweep sweep;
+    float end_frequency_hz;
+    float sweep_time_s;
+    // A WAV file to loop instead of a generated waveform, or NULL.
+    char const *input_path;
+    // Where to report problems and changes, or NULL to stay quiet. If verbose
+    // is set, details of the setup go there too.
+    FILE *log;
+    bool verbose;
+};
+
+// Counters for things that went wrong during playback, and the current setup.
+struct piep_stats {
+    uint64_t frames_written;
+    unsigned long underruns;
+    unsigned long suspends;
+    unsigned long ring_underruns;
+    unsigned int rate_hz;
+    unsigned long period_size_frames;
+    unsigned long buffer_size_frames;
+};
+
+struct piep;
+
+// Fills in the defaults: a 440 Hz sine at full amplitude on the default
+// device.
+void piep_config_init(struct piep_config *config);
+
+// Opens the device, negotiates parameters and prepares what to play. Playback
+// starts once piep_handle_events has filled the buffer. Errors are reported
+// on the log as well, except for -EBUSY when another program holds the
+// device; piep_open and piep_start then fail right away, and it is up to the
+// caller to try again later.
+int piep_open(struct piep **piep, struct piep_config const *config);
+void piep_close(struct piep *piep);
+
+// Closes the device, but keeps everything else, so that piep_start can pick
+// up again later without preparing the sound from scratch.
+void piep_stop(struct piep *piep);
+int piep_start(struct piep *piep);
+
+// Return the descriptors to poll, like their alsa-lib counterparts. They may
+// change after piep_start and after piep_handle_events, so ask again before
+// each poll. There are none while the engine is stopped.
+int piep_poll_descriptors_count(struct piep *piep);
+int piep_poll_descriptors(struct piep *piep, struct pollfd *fds, unsigned int space);
+
+// Writes as much as the device will take, after poll reported events on the
+// descriptors. Returns 0 or a negative error code for problems that can't be
+// recovered from.
+int piep_handle_events(struct piep *piep, struct pollfd *fds, unsigned int nfds);
+
+// Switches to a different generated tone. Fails with -EINVAL when playing a
+// sweep or a file, or when the frequency is out of range, and with -ENOMEM
+// if there is no memory for the new tone. The old one keeps playing then.
+int piep_set_tone(struct piep *piep, enum piep_waveform waveform, float frequency_hz, float amplitude);
+
+void piep_get_stats(struct piep *piep, struct piep_stats *stats);
+
+// Touches every buffer the engine plays from, so that playback doesn't page
+// fault later. Useful together with real-time scheduling.
+void piep_prefault(struct piep *piep);
+
+#endif
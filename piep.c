@@ -1,14 +1,27 @@
+#define _GNU_SOURCE
+
+#include "libpiep.h"
+
 #include <alsa/asoundlib.h>
 
-#include <alloca.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "probe.h"
+#include "verify.h"
 
+#include <errno.h>
 #include <getopt.h>
-#include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-#define PI 3.1415926535897932384626433
+#include <string.h>
+#include <unistd.h>
 
 #define ABORT(fn, err) \
     do { \
@@ -16,15 +29,50 @@
         exit(EXIT_FAILURE); \
     } while (0)
 
-#define CHECKED(fn, ...) \
-    do { \
-        int err = fn(__VA_ARGS__); \
-        if (err < 0) { \
-            ABORT(fn, err); \
-        } \
-    } while (0)
+// Default priority for --realtime. Audio servers typically run somewhere
+// between 5 and 20; we want to be above them, but well below the kernel's own
+// threaded interrupt handlers at 50.
+#define REALTIME_DEFAULT_PRIORITY 20
+
+// How much stack to touch up front in real-time mode, so that the write loop
+// never faults in a new stack page.
+#define PREFAULT_STACK_BYTES (64 * 1024)
+
+// How the program is set up to run, to go with the playback statistics.
+struct stats {
+    struct timespec start;
+    int policy;
+    int priority;
+    int cpu;
+    bool memory_locked;
+};
+
+// Default time to wait for devices to answer for --probe.
+#define PROBE_DEFAULT_TIMEOUT_MS 2000
+
+// Maximum number of --active windows.
+#define MAX_WINDOWS 16
+
+// How long to wait before trying again to open a busy device, with --wait or
+// when an --active window starts.
+#define START_RETRY_S 1
 
-typedef int16_t sample;
+// A time of day during which we play, on certain days of the week. A window
+// may extend past midnight, in which case it belongs to the day on which it
+// starts.
+struct window {
+    unsigned int start_min;
+    unsigned int duration_min;
+    // Bit N is set if the window starts on day N, with 0 being Sunday like
+    // in struct tm.
+    unsigned int days;
+};
+
+char const *const weekday_names[7] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+
+// Set from signal handlers, and acted upon by the main loop.
+volatile sig_atomic_t stats_requested = 0;
+volatile sig_atomic_t exit_requested = 0;
 
 void help(char const *argv0) {
     printf(
@@ -32,34 +80,358 @@ void help(char const *argv0) {
         "Play an infinite sine wave tone through ALSA\n"
         "\n"
         "Options are:\n"
+        "  -a AMP     Set amplitude between 0 and 1 (default: 1)\n"
         "  -d DEVICE  Set ALSA device name for playback (default: \"default\")\n"
         "  -f FREQ    Set tone frequency in Hz (default: 440)\n"
         "  -h         Show this help\n"
+        "  -i FILE    Loop a WAV file instead of a generated waveform; this\n"
+        "             ignores -a, -f and -w and defaults -r to the file's rate\n"
         "  -r FREQ    Set output sample rate in Hz (default: 44100)\n"
+        "  -s SWEEP   Repeatedly sweep a sine from -f to -e, either linearly (lin)\n"
+        "             or logarithmically (log); this ignores -w\n"
+        "  -e FREQ    Set sweep end frequency in Hz (default: 1000)\n"
+        "  -t TIME    Set sweep duration in seconds (default: 10)\n"
         "  -v         Enable verbose output on stderr\n"
-        , argv0
+        "  -w WAVE    Set waveform: sine, square, triangle, saw, white or pink\n"
+        "             (default: sine)\n"
+        "  --realtime[=PRIO]\n"
+        "             Run with SCHED_FIFO at the given priority (default: %d),\n"
+        "             lock all memory and prefault buffers before playing\n"
+        "  --round-robin\n"
+        "             Use SCHED_RR instead of SCHED_FIFO for --realtime\n"
+        "  --cpu=CPU  Pin playback to the given CPU\n"
+        "  --active=HH:MM-HH:MM[@DAYS]\n"
+        "             Only play during this time of day, and optionally only on\n"
+        "             these days, like mon-fri or sat,sun. May be given several\n"
+        "             times. Outside these windows the device is closed.\n"
+        "  --wait     If another program holds the device, wait for it to be\n"
+        "             released rather than exit\n"
+        "  --raw      Bypass alsa-lib and drive the kernel PCM device directly;\n"
+        "             -d must then be hw:CARD[,DEVICE] or a /dev/snd path\n"
+        "  --verify   Play the tone or sweep given by the other options offline\n"
+        "             through every write path into in-memory devices, with\n"
+        "             underruns and suspends along the way, check that all of\n"
+        "             them play it exactly and that its frequency, level and\n"
+        "             harmonics are right, and exit with a failure status if\n"
+        "             anything is off\n"
+        "  --probe[=TIMEOUT]\n"
+        "             List all playback devices and their capabilities as JSON on\n"
+        "             stdout and exit; devices that don't answer within TIMEOUT\n"
+        "             milliseconds (default: %d) are skipped\n"
+        "\n"
+        "Send SIGUSR1 to print playback statistics on stderr.\n"
+        , argv0, REALTIME_DEFAULT_PRIORITY, PROBE_DEFAULT_TIMEOUT_MS
     );
 }
 
+void handle_stats_signal(int signum) {
+    (void) signum;
+    stats_requested = 1;
+}
+
+void handle_exit_signal(int signum) {
+    (void) signum;
+    exit_requested = 1;
+}
+
+void print_stats(struct stats const *stats, struct piep *piep) {
+    struct piep_stats playback = { 0 };
+    if (piep) {
+        piep_get_stats(piep, &playback);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double uptime_s = (now.tv_sec - stats->start.tv_sec) + (now.tv_nsec - stats->start.tv_nsec) * 1e-9;
+    char const *policy = stats->policy == SCHED_FIFO ? "SCHED_FIFO" :
+        stats->policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER";
+    fprintf(stderr,
+        "Stats after %.0f s: %llu frames written, %lu underruns (%.2f/hour), %lu suspends, "
+        "%lu sweep ring underruns; scheduling %s priority %d, memory %s, CPU %d\n",
+        uptime_s, (unsigned long long) playback.frames_written, playback.underruns,
+        playback.underruns * 3600.0 / (uptime_s > 1.0 ? uptime_s : 1.0), playback.suspends,
+        playback.ring_underruns, policy, stats->priority,
+        stats->memory_locked ? "locked" : "not locked", stats->cpu);
+}
+
+// Switches the calling thread to a real-time scheduling policy. Threads it
+// creates later inherit this. Failure is not fatal; we just play on with
+// normal scheduling.
+void enter_realtime(int policy, int priority, struct stats *stats) {
+    struct sched_param param = { .sched_priority = priority };
+    int err = sched_setscheduler(0, policy, &param);
+    if (err < 0 && errno == EPERM) {
+        // Unprivileged users may still be allowed a real-time priority through
+        // RLIMIT_RTPRIO, for example by membership of the audio group, but the
+        // soft limit is often lower than the hard one.
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_RTPRIO, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_RTPRIO, &limit);
+            err = sched_setscheduler(0, policy, &param);
+        }
+    }
+    if (err < 0) {
+        fprintf(stderr, "Warning: sched_setscheduler: %s; continuing without real-time scheduling\n",
+            strerror(errno));
+    } else {
+        stats->policy = policy;
+        stats->priority = priority;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "Warning: mlockall: %s; continuing without locked memory\n", strerror(errno));
+    } else {
+        stats->memory_locked = true;
+    }
+}
+
+void pin_to_cpu(int cpu, struct stats *stats) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Warning: sched_setaffinity: %s; continuing on any CPU\n", strerror(errno));
+    } else {
+        stats->cpu = cpu;
+    }
+}
+
+void prefault_stack(void) {
+    volatile unsigned char stack[PREFAULT_STACK_BYTES];
+    for (size_t i = 0; i < sizeof(stack); i += 256) {
+        stack[i] = 0;
+    }
+}
+
+// Parses a time like "18:00" into minutes since midnight.
+char const *parse_time_of_day(char const *spec, unsigned int *minutes) {
+    char *end;
+    unsigned long hours = strtoul(spec, &end, 10);
+    if (end == spec || *end != ':' || hours > 23) {
+        return NULL;
+    }
+    spec = end + 1;
+    unsigned long mins = strtoul(spec, &end, 10);
+    if (end != spec + 2 || mins > 59) {
+        return NULL;
+    }
+    *minutes = hours * 60 + mins;
+    return end;
+}
+
+char const *parse_weekday(char const *spec, unsigned int *day) {
+    for (unsigned int i = 0; i < 7; i++) {
+        if (strncasecmp(spec, weekday_names[i], 3) == 0) {
+            *day = i;
+            return spec + 3;
+        }
+    }
+    return NULL;
+}
+
+// Parses a window like "18:00-01:00" or "10:00-02:00@fri-sun,tue".
+bool parse_window(char const *spec, struct window *window) {
+    unsigned int end_min;
+    if (!(spec = parse_time_of_day(spec, &window->start_min)) || *spec++ != '-' ||
+            !(spec = parse_time_of_day(spec, &end_min))) {
+        return false;
+    }
+    // An end equal to the start means all day.
+    window->duration_min = (end_min + 24 * 60 - window->start_min) % (24 * 60);
+    if (window->duration_min == 0) {
+        window->duration_min = 24 * 60;
+    }
+    if (*spec == '\0') {
+        window->days = 0x7F;
+        return true;
+    }
+    if (*spec++ != '@') {
+        return false;
+    }
+    window->days = 0;
+    while (true) {
+        unsigned int first, last;
+        if (!(spec = parse_weekday(spec, &first))) {
+            return false;
+        }
+        last = first;
+        if (*spec == '-' && !(spec = parse_weekday(spec + 1, &last))) {
+            return false;
+        }
+        // Ranges may wrap around the weekend, like fri-mon.
+        for (unsigned int day = first; ; day = (day + 1) % 7) {
+            window->days |= 1u << day;
+            if (day == last) {
+                break;
+            }
+        }
+        if (*spec == '\0') {
+            return true;
+        }
+        if (*spec++ != ',') {
+            return false;
+        }
+    }
+}
+
+bool window_active(struct window const *windows, unsigned int num_windows, time_t now) {
+    struct tm local;
+    localtime_r(&now, &local);
+    unsigned int minute = local.tm_hour * 60 + local.tm_min;
+    unsigned int yesterday = (local.tm_wday + 6) % 7;
+    for (unsigned int i = 0; i < num_windows; i++) {
+        struct window const *window = &windows[i];
+        unsigned int end_min = window->start_min + window->duration_min;
+        if ((window->days & (1u << local.tm_wday)) && minute >= window->start_min && minute < end_min) {
+            return true;
+        }
+        // Still going from yesterday, past midnight.
+        if ((window->days & (1u << yesterday)) && end_min > 24 * 60 && minute < end_min - 24 * 60) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the first time after now at which a window starts.
+time_t next_window_start(struct window const *windows, unsigned int num_windows, time_t now) {
+    struct tm today;
+    localtime_r(&now, &today);
+    time_t next = 0;
+    for (unsigned int i = 0; i < num_windows; i++) {
+        for (int days_ahead = 0; days_ahead <= 7; days_ahead++) {
+            if (!(windows[i].days & (1u << (today.tm_wday + days_ahead) % 7))) {
+                continue;
+            }
+            // Let mktime take care of month ends and daylight saving time.
+            struct tm start = today;
+            start.tm_mday += days_ahead;
+            start.tm_hour = windows[i].start_min / 60;
+            start.tm_min = windows[i].start_min % 60;
+            start.tm_sec = 0;
+            start.tm_isdst = -1;
+            time_t candidate = mktime(&start);
+            if (candidate > now && (next == 0 || candidate < next)) {
+                next = candidate;
+            }
+        }
+    }
+    return next;
+}
+
+// Returns the wall clock time from the clock that the window timer runs on.
+// time() reads a coarser copy that can lag behind by a tick, so right when
+// the timer fires, the window would not seem to have started yet.
+time_t realtime_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec;
+}
+
+// Sleeps until a window starts. This takes no CPU at all in the meantime:
+// the timer fires exactly once, unless the wall clock is changed, in which
+// case the kernel cancels it and we compute the next start again.
+void wait_for_window(struct window const *windows, unsigned int num_windows, int timer_fd,
+        struct stats const *stats, struct piep *piep, bool verbose) {
+    while (!exit_requested && !window_active(windows, num_windows, realtime_now())) {
+        time_t start = next_window_start(windows, num_windows, realtime_now());
+        if (verbose) {
+            char text[64];
+            struct tm local;
+            localtime_r(&start, &local);
+            strftime(text, sizeof(text), "%a %Y-%m-%d %H:%M", &local);
+            fprintf(stderr, "Sleeping until %s\n", text);
+        }
+        struct itimerspec timer = { .it_value = { .tv_sec = start } };
+        if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &timer, NULL) < 0) {
+            fprintf(stderr, "timerfd_settime: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+            if (errno == ECANCELED) {
+                if (verbose) {
+                    fprintf(stderr, "Clock changed\n");
+                }
+            } else if (errno == EINTR) {
+                if (stats_requested) {
+                    stats_requested = 0;
+                    print_stats(stats, piep);
+                }
+            } else {
+                fprintf(stderr, "read timerfd: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
 int main(int argc, char **argv) {
-    char const *device = "default";
-    float frequency_hz = 440.0f;
-    unsigned int rate_hz = 44100;
-    bool verbose = false;
+    struct piep_config config;
+    piep_config_init(&config);
+    config.log = stderr;
+    bool realtime = false;
+    int realtime_policy = SCHED_FIFO;
+    int realtime_priority = REALTIME_DEFAULT_PRIORITY;
+    int cpu = -1;
+    struct window windows[MAX_WINDOWS];
+    unsigned int num_windows = 0;
+    bool probe = false;
+    bool verify = false;
+    bool wait = false;
+    unsigned int probe_timeout_ms = PROBE_DEFAULT_TIMEOUT_MS;
+
+    enum {
+        OPT_REALTIME = 256,
+        OPT_ROUND_ROBIN,
+        OPT_CPU,
+        OPT_RAW,
+        OPT_WAIT,
+        OPT_ACTIVE,
+        OPT_PROBE,
+        OPT_VERIFY,
+    };
+    struct option const long_options[] = {
+        { "realtime", optional_argument, NULL, OPT_REALTIME },
+        { "round-robin", no_argument, NULL, OPT_ROUND_ROBIN },
+        { "cpu", required_argument, NULL, OPT_CPU },
+        { "raw", no_argument, NULL, OPT_RAW },
+        { "wait", no_argument, NULL, OPT_WAIT },
+        { "active", required_argument, NULL, OPT_ACTIVE },
+        { "probe", optional_argument, NULL, OPT_PROBE },
+        { "verify", no_argument, NULL, OPT_VERIFY },
+        { NULL, 0, NULL, 0 },
+    };
 
     while (1) {
-        int opt = getopt(argc, argv, "d:hf:r:v");
+        int opt = getopt_long(argc, argv, "a:d:e:hf:i:r:s:t:vw:", long_options, NULL);
         if (opt < 0) {
             break;
         }
         char *endptr;
         switch (opt) {
+            case 'a':
+                config.amplitude = strtod(optarg, &endptr);
+                if (endptr == optarg || config.amplitude < 0.0f || config.amplitude > 1.0f) {
+                    help(argv[0]);
+                    fprintf(stderr, "invalid amplitude for -a: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'd':
-                device = optarg;
+                config.device = optarg;
+                break;
+            case 'e':
+                config.end_frequency_hz = strtod(optarg, &endptr);
+                if (endptr == optarg || config.end_frequency_hz <= 0.0f) {
+                    help(argv[0]);
+                    fprintf(stderr, "invalid float for -e: %s", optarg);
+                    return EXIT_FAILURE;
+                }
                 break;
             case 'f':
-                frequency_hz = strtod(optarg, &endptr);
-                if (endptr == optarg) {
+                config.frequency_hz = strtod(optarg, &endptr);
+                if (endptr == optarg || config.frequency_hz <= 0.0f) {
                     help(argv[0]);
                     fprintf(stderr, "invalid float for -f: %s", optarg);
                     return EXIT_FAILURE;
@@ -68,16 +440,102 @@ int main(int argc, char **argv) {
             case 'h':
                 help(argv[0]);
                 return EXIT_SUCCESS;
+            case 'i':
+                config.input_path = optarg;
+                break;
             case 'r':
-                rate_hz = strtol(optarg, &endptr, 10);
+                config.rate_hz = strtol(optarg, &endptr, 10);
                 if (endptr == optarg) {
                     help(argv[0]);
                     fprintf(stderr, "invalid integer for -r: %s", optarg);
                     return EXIT_FAILURE;
                 }
                 break;
+            case 's':
+                if (strcmp(optarg, "lin") == 0) {
+                    config.sweep = PIEP_SWEEP_LINEAR;
+                } else if (strcmp(optarg, "log") == 0) {
+                    config.sweep = PIEP_SWEEP_LOGARITHMIC;
+                } else {
+                    help(argv[0]);
+                    fprintf(stderr, "invalid sweep for -s: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                config.sweep_time_s = strtod(optarg, &endptr);
+                if (endptr == optarg || config.sweep_time_s <= 0.0f) {
+                    help(argv[0]);
+                    fprintf(stderr, "invalid float for -t: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
             case 'v':
-                verbose = true;
+                config.verbose = true;
+                break;
+            case 'w':
+                config.waveform = PIEP_WAVEFORM_COUNT;
+                for (int i = 0; i < PIEP_WAVEFORM_COUNT; i++) {
+                    if (strcmp(optarg, piep_waveform_names[i]) == 0) {
+                        config.waveform = i;
+                    }
+                }
+                if (config.waveform == PIEP_WAVEFORM_COUNT) {
+                    help(argv[0]);
+                    fprintf(stderr, "invalid waveform for -w: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_REALTIME:
+                realtime = true;
+                if (optarg) {
+                    realtime_priority = strtol(optarg, &endptr, 10);
+                    if (endptr == optarg || realtime_priority < sched_get_priority_min(SCHED_FIFO) ||
+                            realtime_priority > sched_get_priority_max(SCHED_FIFO)) {
+                        help(argv[0]);
+                        fprintf(stderr, "invalid priority for --realtime: %s", optarg);
+                        return EXIT_FAILURE;
+                    }
+                }
+                break;
+            case OPT_ROUND_ROBIN:
+                realtime_policy = SCHED_RR;
+                break;
+            case OPT_CPU:
+                cpu = strtol(optarg, &endptr, 10);
+                if (endptr == optarg || cpu < 0 || cpu >= CPU_SETSIZE) {
+                    help(argv[0]);
+                    fprintf(stderr, "invalid CPU for --cpu: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_RAW:
+                config.raw = true;
+                break;
+            case OPT_WAIT:
+                wait = true;
+                break;
+            case OPT_ACTIVE:
+                if (num_windows == MAX_WINDOWS || !parse_window(optarg, &windows[num_windows])) {
+                    help(argv[0]);
+                    fprintf(stderr, "invalid window for --active: %s", optarg);
+                    return EXIT_FAILURE;
+                }
+                num_windows++;
+                break;
+            case OPT_VERIFY:
+                verify = true;
+                break;
+            case OPT_PROBE:
+                probe = true;
+                if (optarg) {
+                    probe_timeout_ms = strtoul(optarg, &endptr, 10);
+                    if (endptr == optarg || probe_timeout_ms == 0) {
+                        help(argv[0]);
+                        fprintf(stderr, "invalid timeout for --probe: %s", optarg);
+                        return EXIT_FAILURE;
+                    }
+                }
                 break;
             default:
                 help(argv[0]);
@@ -85,86 +543,143 @@ int main(int argc, char **argv) {
         }
     }
 
-    snd_output_t *output = NULL;
-    if (verbose) {
-        CHECKED(snd_output_stdio_attach, &output, stderr, 0);
+    if (probe) {
+        int err = probe_devices(stdout, probe_timeout_ms);
+        if (err < 0) {
+            fprintf(stderr, "Failed to list devices: %s\n", snd_strerror(err));
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
     }
 
-    snd_pcm_t *pcm = NULL;
-    CHECKED(snd_pcm_open, &pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (verify) {
+        if (config.input_path) {
+            help(argv[0]);
+            fprintf(stderr, "--verify only checks generated waveforms and sweeps, not -i\n");
+            return EXIT_FAILURE;
+        }
+        return verify_playback(&config, stdout) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    if (verbose) {
-        snd_pcm_dump(pcm, output);
-    }
-
-    snd_pcm_hw_params_t *hw_params;
-    snd_pcm_hw_params_alloca(&hw_params);
-    unsigned int period_time_us = 1000000;
-    unsigned int buffer_time_us = period_time_us * 3;
-    CHECKED(snd_pcm_hw_params_any, pcm, hw_params);
-    CHECKED(snd_pcm_hw_params_set_format, pcm, hw_params, SND_PCM_FORMAT_S16);
-    CHECKED(snd_pcm_hw_params_set_channels, pcm, hw_params, 1);
-    CHECKED(snd_pcm_hw_params_set_rate_near, pcm, hw_params, &rate_hz, NULL);
-    CHECKED(snd_pcm_hw_params_set_buffer_time_near, pcm, hw_params, &buffer_time_us, NULL);
-    CHECKED(snd_pcm_hw_params_set_period_time_near, pcm, hw_params, &period_time_us, NULL);
-    CHECKED(snd_pcm_hw_params, pcm, hw_params);
-    if (verbose) {
-        fprintf(stderr, "Using sample rate %u Hz, buffer time %d us, period time %d us\n",
-            rate_hz, buffer_time_us, period_time_us);
-    }
-
-    // Create a buffer to hold exactly one period of samples. To avoid
-    // confusion with ALSA's internal buffer, we call this a "clip".
-    snd_pcm_uframes_t clip_size_frames;
-    CHECKED(snd_pcm_hw_params_get_period_size, hw_params, &clip_size_frames, NULL);
-    unsigned int clip_size_bytes = clip_size_frames * sizeof(sample);
-    sample *clip = malloc(clip_size_bytes);
-
-    // Round our target frequency so that an integer number of waves fits
-    // inside the clip. This avoids sine calculations during playback because
-    // we can just loop the same clip seamlessly.
-    float clip_time_s = (float) clip_size_frames / (float) rate_hz;
-    float waves_per_clip = frequency_hz * clip_time_s;
-    frequency_hz = clip_time_s * roundf(waves_per_clip);
-    if (verbose) {
-        fprintf(stderr, "Using rounded frequency %f Hz\n", frequency_hz);
+    struct stats stats = {
+        .policy = SCHED_OTHER,
+        .cpu = -1,
+    };
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+
+    struct sigaction action = { .sa_handler = handle_stats_signal };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    action.sa_handler = handle_exit_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Do this before mapping or allocating anything, so that mlockall's
+    // MCL_FUTURE covers all of it.
+    if (cpu >= 0) {
+        pin_to_cpu(cpu, &stats);
+    }
+    if (realtime) {
+        enter_realtime(realtime_policy, realtime_priority, &stats);
     }
 
-    // Fill the clip with a sine wave.
-    for (unsigned int i = 0; i < clip_size_frames; i++) {
-        float sin = sinf((float) i / (float) rate_hz * frequency_hz * 2.0 * PI);
-        clip[i] = (sample) (sin * 0x7FFF);
+    bool verbose = config.verbose;
+    int timer_fd = -1;
+    if (num_windows > 0) {
+        timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+        if (timer_fd < 0) {
+            fprintf(stderr, "timerfd_create: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        wait_for_window(windows, num_windows, timer_fd, &stats, NULL, verbose);
+        if (exit_requested) {
+            return EXIT_SUCCESS;
+        }
     }
 
-    while (1) {
-        snd_pcm_sframes_t result = snd_pcm_writei(pcm, clip, clip_size_frames);
-        if (result < 0) {
-            if (result == -EAGAIN) {
-                // Should not usually happen since we requested blocking writes.
+    // The engine reports its own errors on stderr, so all that is left to do
+    // when it fails is to exit. The exception is a busy device, which it
+    // leaves to us.
+    struct piep *piep;
+    int err;
+    while ((err = piep_open(&piep, &config)) == -EBUSY && wait && !exit_requested) {
+        sleep(START_RETRY_S);
+    }
+    if (exit_requested && err == -EBUSY) {
+        return EXIT_SUCCESS;
+    }
+    if (err == -EBUSY) {
+        fprintf(stderr, "Device %s is busy; use --wait to wait for it\n", config.device);
+    }
+    if (err < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (realtime) {
+        // Memory is already locked, which faults everything in, but it may
+        // not have been allowed.
+        prefault_stack();
+        piep_prefault(piep);
+    }
+
+    while (!exit_requested) {
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats(&stats, piep);
+        }
+
+        if (num_windows > 0 && !window_active(windows, num_windows, realtime_now())) {
+            // Release the device entirely until the next window, so that
+            // the speakers can sleep and other programs can use it.
+            piep_stop(piep);
+            if (verbose) {
+                fprintf(stderr, "Outside active windows, closed device\n");
+            }
+            wait_for_window(windows, num_windows, timer_fd, &stats, piep, verbose);
+            if (exit_requested) {
+                break;
+            }
+            // Another program may still hold the device when the window
+            // opens. Keep trying rather than give up on the whole schedule.
+            while ((err = piep_start(piep)) == -EBUSY && !exit_requested) {
+                sleep(START_RETRY_S);
+            }
+            if (exit_requested) {
+                break;
+            }
+            if (err < 0) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        // The descriptors can change whenever the engine renegotiates, so
+        // ask for them every time.
+        int num_fds = piep_poll_descriptors_count(piep);
+        if (num_fds <= 0) {
+            ABORT(piep_poll_descriptors_count, num_fds < 0 ? num_fds : -EBADFD);
+        }
+        struct pollfd fds[num_fds];
+        num_fds = piep_poll_descriptors(piep, fds, num_fds);
+        if (num_fds < 0) {
+            ABORT(piep_poll_descriptors, num_fds);
+        }
+        if (poll(fds, num_fds, -1) < 0) {
+            if (errno == EINTR) {
+                // Interrupted by a signal; the top of the loop handles it.
                 continue;
-            } else if (result == -EPIPE) {
-                // Buffer underrun.
-                CHECKED(snd_pcm_prepare, pcm);
-            } else if (result == -ESTRPIPE) {
-                // Stream suspended.
-                while (true) {
-                    int err = snd_pcm_resume(pcm);
-                    if (err < 0) {
-                        if (err == -EAGAIN) {
-                            sleep(1);
-                            continue;
-                        } else {
-                            ABORT(snd_pcm_resume, err);
-                        }
-                    }
-                    break;
-                }
-                CHECKED(snd_pcm_prepare, pcm);
-            } else {
-                ABORT(snd_pcm_writei, result);
             }
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (piep_handle_events(piep, fds, num_fds) < 0) {
+            return EXIT_FAILURE;
         }
     }
 
+    if (verbose) {
+        print_stats(&stats, piep);
+    }
+    piep_close(piep);
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+
+#include "probe.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <alsa/asoundlib.h>
+
+// Rates that are worth checking individually, because a rate range doesn't
+// say whether the device supports everything in between.
+static unsigned int const standard_rates_hz[] = {
+    8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000,
+};
+
+struct probe_set;
+
+// One device being probed by its own thread.
+struct probe {
+    struct probe_set *set;
+    char *name;
+    char *description;
+    pthread_t thread;
+
+    // The JSON object describing the device, written by the thread. Guarded
+    // by the set's mutex, together with done.
+    char *json;
+    bool done;
+};
+
+struct probe_set {
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+    unsigned int num_done;
+};
+
+static void json_string(FILE *file, char const *string) {
+    if (!string) {
+        fputs("null", file);
+        return;
+    }
+    fputc('"', file);
+    for (unsigned char const *c = (unsigned char const *) string; *c; c++) {
+        switch (*c) {
+            case '"': fputs("\\\"", file); break;
+            case '\\': fputs("\\\\", file); break;
+            case '\n': fputs("\\n", file); break;
+            case '\t': fputs("\\t", file); break;
+            default:
+                if (*c < 0x20) {
+                    fprintf(file, "\\u%04x", *c);
+                } else {
+                    fputc(*c, file);
+                }
+        }
+    }
+    fputc('"', file);
+}
+
+static void json_range(FILE *file, char const *key, unsigned long min, unsigned long max) {
+    fprintf(file, ",\n      \"%s\": { \"min\": %lu, \"max\": %lu }", key, min, max);
+}
+
+static void json_bool(FILE *file, char const *key, bool value) {
+    fprintf(file, ",\n      \"%s\": %s", key, value ? "true" : "false");
+}
+
+// Writes the fields for an opened device. The configuration space is left
+// unrestricted, so everything is reported that any configuration allows.
+static void describe_pcm(FILE *file, snd_pcm_t *pcm) {
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_hw_params_alloca(&hw_params);
+    int err = snd_pcm_hw_params_any(pcm, hw_params);
+    if (err < 0) {
+        fputs(",\n      \"error\": ", file);
+        json_string(file, snd_strerror(err));
+        return;
+    }
+
+    fputs(",\n      \"access\": [", file);
+    bool first = true;
+    for (int access = 0; access <= SND_PCM_ACCESS_LAST; access++) {
+        if (snd_pcm_hw_params_test_access(pcm, hw_params, (snd_pcm_access_t) access) == 0) {
+            fputs(first ? " " : ", ", file);
+            json_string(file, snd_pcm_access_name((snd_pcm_access_t) access));
+            first = false;
+        }
+    }
+    fputs(" ]", file);
+
+    fputs(",\n      \"formats\": [", file);
+    first = true;
+    for (int format = 0; format <= SND_PCM_FORMAT_LAST; format++) {
+        if (snd_pcm_hw_params_test_format(pcm, hw_params, (snd_pcm_format_t) format) == 0) {
+            fputs(first ? " " : ", ", file);
+            json_string(file, snd_pcm_format_name((snd_pcm_format_t) format));
+            first = false;
+        }
+    }
+    fputs(" ]", file);
+
+    unsigned int channels_min = 0, channels_max = 0;
+    snd_pcm_hw_params_get_channels_min(hw_params, &channels_min);
+    snd_pcm_hw_params_get_channels_max(hw_params, &channels_max);
+    json_range(file, "channels", channels_min, channels_max);
+
+    unsigned int rate_min_hz = 0, rate_max_hz = 0;
+    snd_pcm_hw_params_get_rate_min(hw_params, &rate_min_hz, NULL);
+    snd_pcm_hw_params_get_rate_max(hw_params, &rate_max_hz, NULL);
+    fprintf(file, ",\n      \"rate_hz\": { \"min\": %u, \"max\": %u, \"standard\": [", rate_min_hz, rate_max_hz);
+    first = true;
+    for (size_t i = 0; i < sizeof(standard_rates_hz) / sizeof(standard_rates_hz[0]); i++) {
+        if (snd_pcm_hw_params_test_rate(pcm, hw_params, standard_rates_hz[i], 0) == 0) {
+            fprintf(file, first ? " %u" : ", %u", standard_rates_hz[i]);
+            first = false;
+        }
+    }
+    fputs(" ] }", file);
+
+    snd_pcm_uframes_t buffer_min_frames = 0, buffer_max_frames = 0;
+    snd_pcm_hw_params_get_buffer_size_min(hw_params, &buffer_min_frames);
+    snd_pcm_hw_params_get_buffer_size_max(hw_params, &buffer_max_frames);
+    json_range(file, "buffer_size_frames", buffer_min_frames, buffer_max_frames);
+
+    snd_pcm_uframes_t period_min_frames = 0, period_max_frames = 0;
+    snd_pcm_hw_params_get_period_size_min(hw_params, &period_min_frames, NULL);
+    snd_pcm_hw_params_get_period_size_max(hw_params, &period_max_frames, NULL);
+    json_range(file, "period_size_frames", period_min_frames, period_max_frames);
+
+    unsigned int periods_min = 0, periods_max = 0;
+    snd_pcm_hw_params_get_periods_min(hw_params, &periods_min, NULL);
+    snd_pcm_hw_params_get_periods_max(hw_params, &periods_max, NULL);
+    json_range(file, "periods", periods_min, periods_max);
+
+    unsigned int buffer_min_us = 0, buffer_max_us = 0;
+    snd_pcm_hw_params_get_buffer_time_min(hw_params, &buffer_min_us, NULL);
+    snd_pcm_hw_params_get_buffer_time_max(hw_params, &buffer_max_us, NULL);
+    json_range(file, "buffer_time_us", buffer_min_us, buffer_max_us);
+
+    // Without period wakeups, the only interrupts left are the ones we ask
+    // for, which is the cheapest way to keep a stream going.
+    json_bool(file, "can_disable_period_wakeup", snd_pcm_hw_params_can_disable_period_wakeup(hw_params));
+    json_bool(file, "can_pause", snd_pcm_hw_params_can_pause(hw_params));
+    json_bool(file, "can_resume", snd_pcm_hw_params_can_resume(hw_params));
+    json_bool(file, "batch", snd_pcm_hw_params_is_batch(hw_params));
+    json_bool(file, "block_transfer", snd_pcm_hw_params_is_block_transfer(hw_params));
+
+    fputs(",\n      \"channel_maps\": [", file);
+    snd_pcm_chmap_query_t **maps = snd_pcm_query_chmaps(pcm);
+    if (maps) {
+        for (snd_pcm_chmap_query_t **map = maps; *map; map++) {
+            fputs(map == maps ? "\n        { \"type\": " : ",\n        { \"type\": ", file);
+            json_string(file, snd_pcm_chmap_type_name((*map)->type));
+            fputs(", \"positions\": [", file);
+            for (unsigned int i = 0; i < (*map)->map.channels; i++) {
+                fputs(i == 0 ? " " : ", ", file);
+                json_string(file, snd_pcm_chmap_name((*map)->map.pos[i]));
+            }
+            fputs(" ] }", file);
+        }
+        snd_pcm_free_chmaps(maps);
+        fputs("\n      ]", file);
+    } else {
+        fputs("]", file);
+    }
+}
+
+static void *probe_thread(void *arg) {
+    struct probe *probe = arg;
+
+    char *json = NULL;
+    size_t json_size = 0;
+    FILE *file = open_memstream(&json, &json_size);
+    if (!file) {
+        json = NULL;
+    } else {
+        fputs("    {\n      \"name\": ", file);
+        json_string(file, probe->name);
+        fputs(",\n      \"description\": ", file);
+        json_string(file, probe->description);
+
+        // Non-blocking, so that a device that is in use fails right away
+        // instead of waiting for it to be released.
+        snd_pcm_t *pcm;
+        int err = snd_pcm_open(&pcm, probe->name, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
+        if (err < 0) {
+            fputs(",\n      \"error\": ", file);
+            json_string(file, snd_strerror(err));
+        } else {
+            describe_pcm(file, pcm);
+            snd_pcm_close(pcm);
+        }
+        fputs("\n    }", file);
+        fclose(file);
+    }
+
+    pthread_mutex_lock(&probe->set->mutex);
+    probe->json = json;
+    probe->done = true;
+    probe->set->num_done++;
+    pthread_cond_signal(&probe->set->done_cond);
+    pthread_mutex_unlock(&probe->set->mutex);
+    return NULL;
+}
+
+int probe_devices(FILE *file, unsigned int timeout_ms) {
+    void **hints;
+    int err = snd_device_name_hint(-1, "pcm", &hints);
+    if (err < 0) {
+        return err;
+    }
+
+    unsigned int num_probes = 0;
+    for (void **hint = hints; *hint; hint++) {
+        num_probes++;
+    }
+    struct probe *probes = calloc(num_probes, sizeof(struct probe));
+    struct probe_set *set = malloc(sizeof(struct probe_set));
+    if (!probes || !set) {
+        free(probes);
+        free(set);
+        snd_device_name_free_hint(hints);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&set->mutex, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&set->done_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    set->num_done = 0;
+
+    // Threads are detached, because the ones that hang are abandoned. For
+    // the same reason, nothing they use is ever freed.
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    unsigned int num_started = 0;
+    for (void **hint = hints; *hint; hint++) {
+        char *name = snd_device_name_get_hint(*hint, "NAME");
+        char *ioid = snd_device_name_get_hint(*hint, "IOID");
+        // No IOID means the device does both playback and capture.
+        bool playback = name && (!ioid || strcmp(ioid, "Output") == 0);
+        free(ioid);
+        if (!playback) {
+            free(name);
+            continue;
+        }
+        struct probe *probe = &probes[num_started];
+        probe->set = set;
+        probe->name = name;
+        probe->description = snd_device_name_get_hint(*hint, "DESC");
+        if (pthread_create(&probe->thread, &thread_attr, probe_thread, probe) != 0) {
+            // The threads started so far count under the lock as well.
+            pthread_mutex_lock(&set->mutex);
+            probe->json = NULL;
+            probe->done = true;
+            set->num_done++;
+            pthread_mutex_unlock(&set->mutex);
+        }
+        num_started++;
+    }
+    pthread_attr_destroy(&thread_attr);
+    snd_device_name_free_hint(hints);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&set->mutex);
+    while (set->num_done < num_started) {
+        if (pthread_cond_timedwait(&set->done_cond, &set->mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    fputs("{\n  \"devices\": [\n", file);
+    for (unsigned int i = 0; i < num_started; i++) {
+        struct probe *probe = &probes[i];
+        if (probe->json) {
+            fputs(probe->json, file);
+        } else {
+            fputs("    {\n      \"name\": ", file);
+            json_string(file, probe->name);
+            fputs(",\n      \"description\": ", file);
+            json_string(file, probe->description);
+            fputs(",\n      \"error\": ", file);
+            json_string(file, probe->done ? "probe failed" : "timed out");
+            fputs("\n    }", file);
+        }
+        fputs(i + 1 < num_started ? ",\n" : "\n", file);
+    }
+    fputs("  ]\n}\n", file);
+    fflush(file);
+    pthread_mutex_unlock(&set->mutex);
+    return 0;
+}
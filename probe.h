@@ -0,0 +1,16 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdio.h>
+
+// Lists every playback PCM that alsa-lib knows about, along with what each
+// one supports, as JSON. Devices are opened in parallel, and any device that
+// has not answered within the timeout is reported as such, so that one hung
+// card does not hold up the rest.
+//
+// Returns 0 on success, or a negative error code if the devices could not be
+// enumerated at all. Failing to open individual devices is not an error;
+// those are listed with the reason.
+int probe_devices(FILE *file, unsigned int timeout_ms);
+
+#endif
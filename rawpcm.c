@@ -0,0 +1,781 @@
+#define _GNU_SOURCE
+
+#include "rawpcm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <endian.h>
+#include <sound/asound.h>
+
+// piep plays native-endian 16-bit samples. Devices that don't take those get
+// them in the upper half of 32-bit ones.
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define RAW_PCM_FORMAT SNDRV_PCM_FORMAT_S16_LE
+#define RAW_PCM_FORMAT_WIDE SNDRV_PCM_FORMAT_S32_LE
+#else
+#define RAW_PCM_FORMAT SNDRV_PCM_FORMAT_S16_BE
+#define RAW_PCM_FORMAT_WIDE SNDRV_PCM_FORMAT_S32_BE
+#endif
+
+struct raw_pcm {
+    int fd;
+    char path[64];
+    int protocol_version;
+
+    // Negotiated setup.
+    snd_pcm_access_t access;
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned int rate_hz;
+    snd_pcm_uframes_t period_size_frames;
+    snd_pcm_uframes_t buffer_size_frames;
+    snd_pcm_uframes_t boundary;
+    unsigned int frame_bytes;
+
+    // The buffer, if the device supports mmap access. Otherwise we fall back
+    // to the WRITEI_FRAMES ioctl, and tile looped writes into a period sized
+    // scratch buffer first, so that each ioctl passes a whole period. Frames
+    // that have to be converted to the device's format go through it too.
+    void *data;
+    size_t data_size;
+    void *scratch;
+
+    // Either the kernel's status and control pages mapped into our memory,
+    // or, on architectures where the kernel doesn't allow that, a private
+    // copy that is exchanged with the SYNC_PTR ioctl.
+    struct snd_pcm_mmap_status volatile *status;
+    struct snd_pcm_mmap_control volatile *control;
+    bool use_sync_ptr;
+    struct snd_pcm_sync_ptr sync_ptr;
+
+    // Devices opened with piep_raw_open_memory have no file descriptor. Their
+    // buffer is ordinary memory, only piep_raw_memory_play moves the hardware
+    // pointer, and state changes happen here rather than in the kernel.
+    bool memory;
+    void *memory_buffer;
+};
+
+// Brings our view of the hardware pointer and state up to date, and tells
+// the kernel about our application pointer. With the pages mapped, the
+// kernel already sees our application pointer directly.
+static int piep_raw_sync(struct raw_pcm *pcm) {
+    if (pcm->memory) {
+        return 0;
+    }
+    if (pcm->use_sync_ptr) {
+        pcm->sync_ptr.flags = SNDRV_PCM_SYNC_PTR_HWSYNC | SNDRV_PCM_SYNC_PTR_AVAIL_MIN;
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SYNC_PTR, &pcm->sync_ptr) < 0) {
+            return -errno;
+        }
+    } else if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HWSYNC) < 0) {
+        // Fails in states without a running hardware pointer, which is fine:
+        // the state in the status page tells us what is going on.
+        if (errno != EBADFD && errno != EPIPE && errno != ESTRPIPE) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+// Returns the error code that alsa-lib would return for the current state,
+// or 0 if data can be written in it.
+static int piep_raw_state_error(struct raw_pcm *pcm) {
+    switch (pcm->status->state) {
+        case SNDRV_PCM_STATE_XRUN:
+            return -EPIPE;
+        case SNDRV_PCM_STATE_SUSPENDED:
+            return -ESTRPIPE;
+        case SNDRV_PCM_STATE_DISCONNECTED:
+            return -ENODEV;
+        case SNDRV_PCM_STATE_OPEN:
+        case SNDRV_PCM_STATE_SETUP:
+            return -EBADFD;
+        default:
+            return 0;
+    }
+}
+
+static long piep_raw_avail_frames(struct raw_pcm *pcm) {
+    snd_pcm_sframes_t avail = pcm->status->hw_ptr + pcm->buffer_size_frames - pcm->control->appl_ptr;
+    if (avail < 0) {
+        avail += pcm->boundary;
+    } else if ((snd_pcm_uframes_t) avail >= pcm->boundary) {
+        avail -= pcm->boundary;
+    }
+    return avail;
+}
+
+static snd_pcm_uframes_t piep_raw_advance(struct raw_pcm *pcm, snd_pcm_uframes_t pointer, snd_pcm_uframes_t frames) {
+    pointer += frames;
+    return pointer >= pcm->boundary ? pointer - pcm->boundary : pointer;
+}
+
+// The kernel computes the boundary the same way.
+static void piep_raw_set_boundary(struct raw_pcm *pcm) {
+    pcm->boundary = pcm->buffer_size_frames;
+    while (pcm->boundary * 2 <= LONG_MAX - pcm->buffer_size_frames) {
+        pcm->boundary *= 2;
+    }
+}
+
+static int piep_raw_resolve_name(char const *name, char *path, size_t size) {
+    if (name[0] == '/') {
+        snprintf(path, size, "%s", name);
+        return 0;
+    }
+    if (strncmp(name, "hw:", 3) != 0) {
+        return -EINVAL;
+    }
+    char card_id[32];
+    int device = 0;
+    size_t card_length = strcspn(name + 3, ",");
+    if (card_length == 0 || card_length >= sizeof(card_id)) {
+        return -EINVAL;
+    }
+    memcpy(card_id, name + 3, card_length);
+    card_id[card_length] = '\0';
+    if (name[3 + card_length] == ',') {
+        char *end;
+        device = strtol(name + 4 + card_length, &end, 10);
+        if (*end || device < 0) {
+            return -EINVAL;
+        }
+    }
+
+    char *end;
+    int card = strtol(card_id, &end, 10);
+    if (*end || card < 0) {
+        // A card ID like "PCH". The kernel links /proc/asound/ID to cardN.
+        char link_path[64];
+        char target[32];
+        snprintf(link_path, sizeof(link_path), "/proc/asound/%s", card_id);
+        ssize_t length = readlink(link_path, target, sizeof(target) - 1);
+        if (length < 0) {
+            return -ENOENT;
+        }
+        target[length] = '\0';
+        if (sscanf(target, "card%d", &card) != 1) {
+            return -ENOENT;
+        }
+    }
+    snprintf(path, size, "/dev/snd/pcmC%dD%dp", card, device);
+    return 0;
+}
+
+int piep_raw_open(struct raw_pcm **pcm_out, char const *name) {
+    struct raw_pcm *pcm = calloc(1, sizeof(struct raw_pcm));
+    if (!pcm) {
+        return -ENOMEM;
+    }
+    int err = piep_raw_resolve_name(name, pcm->path, sizeof(pcm->path));
+    if (err < 0) {
+        free(pcm);
+        return err;
+    }
+    // Without O_NONBLOCK, opening a busy device waits until it is released,
+    // rather than failing. Writes never block either; callers poll instead.
+    pcm->fd = open(pcm->path, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if (pcm->fd < 0) {
+        err = -errno;
+        free(pcm);
+        return err;
+    }
+
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_PVERSION, &pcm->protocol_version) < 0) {
+        err = -errno;
+        piep_raw_close(pcm);
+        return err;
+    }
+    // Let the kernel know which protocol we speak, so that it doesn't apply
+    // workarounds for ancient userspace. Older kernels don't know this ioctl.
+    int user_version = SNDRV_PCM_VERSION;
+    ioctl(pcm->fd, SNDRV_PCM_IOCTL_USER_PVERSION, &user_version);
+    // Trigger timestamps on the same clock as piep's own measurements.
+    int tstamp_type = SNDRV_PCM_TSTAMP_TYPE_MONOTONIC;
+    ioctl(pcm->fd, SNDRV_PCM_IOCTL_TTSTAMP, &tstamp_type);
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *status = mmap(NULL, page_size, PROT_READ, MAP_SHARED, pcm->fd, SNDRV_PCM_MMAP_OFFSET_STATUS);
+    void *control = status == MAP_FAILED ? MAP_FAILED :
+        mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, pcm->fd, SNDRV_PCM_MMAP_OFFSET_CONTROL);
+    if (control == MAP_FAILED) {
+        if (status != MAP_FAILED) {
+            munmap(status, page_size);
+        }
+        pcm->use_sync_ptr = true;
+        pcm->status = &pcm->sync_ptr.s.status;
+        pcm->control = &pcm->sync_ptr.c.control;
+    } else {
+        pcm->status = status;
+        pcm->control = control;
+    }
+
+    *pcm_out = pcm;
+    return 0;
+}
+
+int piep_raw_open_memory(struct raw_pcm **pcm_out, bool mmap, unsigned int rate_hz,
+        unsigned long period_size_frames, unsigned long buffer_size_frames) {
+    struct raw_pcm *pcm = calloc(1, sizeof(struct raw_pcm));
+    if (!pcm) {
+        return -ENOMEM;
+    }
+    pcm->fd = -1;
+    pcm->memory = true;
+    snprintf(pcm->path, sizeof(pcm->path), "memory");
+    pcm->protocol_version = SNDRV_PCM_VERSION;
+    pcm->access = mmap ? SNDRV_PCM_ACCESS_MMAP_INTERLEAVED : SNDRV_PCM_ACCESS_RW_INTERLEAVED;
+    pcm->format = RAW_PCM_FORMAT;
+    pcm->channels = 1;
+    pcm->rate_hz = rate_hz;
+    pcm->period_size_frames = period_size_frames;
+    pcm->buffer_size_frames = buffer_size_frames;
+    pcm->frame_bytes = sizeof(int16_t);
+    piep_raw_set_boundary(pcm);
+    pcm->use_sync_ptr = true;
+    pcm->status = &pcm->sync_ptr.s.status;
+    pcm->control = &pcm->sync_ptr.c.control;
+    pcm->status->state = SNDRV_PCM_STATE_PREPARED;
+
+    pcm->memory_buffer = malloc(buffer_size_frames * pcm->frame_bytes);
+    if (mmap) {
+        pcm->data = pcm->memory_buffer;
+        pcm->data_size = buffer_size_frames * pcm->frame_bytes;
+    } else {
+        pcm->scratch = malloc(period_size_frames * pcm->frame_bytes);
+    }
+    if (!pcm->memory_buffer || (!mmap && !pcm->scratch)) {
+        piep_raw_close(pcm);
+        return -ENOMEM;
+    }
+    *pcm_out = pcm;
+    return 0;
+}
+
+void piep_raw_close(struct raw_pcm *pcm) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pcm->data && !pcm->memory) {
+        munmap(pcm->data, pcm->data_size);
+    }
+    free(pcm->memory_buffer);
+    free(pcm->scratch);
+    if (pcm->status && !pcm->use_sync_ptr) {
+        munmap((void *) pcm->status, page_size);
+        munmap((void *) pcm->control, page_size);
+    }
+    if (pcm->fd >= 0) {
+        close(pcm->fd);
+    }
+    free(pcm);
+}
+
+static struct snd_mask *param_mask(struct snd_pcm_hw_params *params, int param) {
+    return &params->masks[param - SNDRV_PCM_HW_PARAM_FIRST_MASK];
+}
+
+static struct snd_interval *param_interval(struct snd_pcm_hw_params *params, int param) {
+    return &params->intervals[param - SNDRV_PCM_HW_PARAM_FIRST_INTERVAL];
+}
+
+static void set_mask(struct snd_pcm_hw_params *params, int param, unsigned int value) {
+    struct snd_mask *mask = param_mask(params, param);
+    memset(mask, 0, sizeof(*mask));
+    mask->bits[value / 32] = 1u << (value % 32);
+    params->rmask |= 1u << param;
+}
+
+static void set_interval(struct snd_pcm_hw_params *params, int param, unsigned int min, unsigned int max) {
+    struct snd_interval *interval = param_interval(params, param);
+    memset(interval, 0, sizeof(*interval));
+    interval->min = min;
+    interval->max = max;
+    interval->integer = 1;
+    params->rmask |= 1u << param;
+}
+
+static unsigned int interval_min(struct snd_pcm_hw_params *params, int param) {
+    struct snd_interval *interval = param_interval(params, param);
+    return interval->min + interval->openmin;
+}
+
+static unsigned int interval_max(struct snd_pcm_hw_params *params, int param) {
+    struct snd_interval *interval = param_interval(params, param);
+    return interval->max - interval->openmax;
+}
+
+// The equivalent of snd_pcm_hw_params_any: everything is allowed, and the
+// kernel narrows it down to what the hardware supports.
+static void params_any(struct snd_pcm_hw_params *params) {
+    memset(params, 0, sizeof(*params));
+    for (int param = SNDRV_PCM_HW_PARAM_FIRST_MASK; param <= SNDRV_PCM_HW_PARAM_LAST_MASK; param++) {
+        memset(param_mask(params, param), 0xFF, sizeof(struct snd_mask));
+    }
+    for (int param = SNDRV_PCM_HW_PARAM_FIRST_INTERVAL; param <= SNDRV_PCM_HW_PARAM_LAST_INTERVAL; param++) {
+        param_interval(params, param)->max = UINT_MAX;
+    }
+    params->rmask = ~0u;
+    params->info = ~0u;
+}
+
+static int refine(struct raw_pcm *pcm, struct snd_pcm_hw_params *params) {
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HW_REFINE, params) < 0) {
+        return -errno;
+    }
+    params->rmask = 0;
+    return 0;
+}
+
+// Restricts an integer parameter to the supported value nearest to the given
+// one, like the snd_pcm_hw_params_set_*_near functions do.
+static int refine_near(struct raw_pcm *pcm, struct snd_pcm_hw_params *params, int param, unsigned int value) {
+    struct snd_pcm_hw_params attempt = *params;
+    set_interval(&attempt, param, value, value);
+    if (refine(pcm, &attempt) == 0) {
+        *params = attempt;
+        return 0;
+    }
+
+    // Find the nearest supported values on either side.
+    struct snd_pcm_hw_params above = *params;
+    set_interval(&above, param, value, UINT_MAX);
+    bool have_above = refine(pcm, &above) == 0;
+    struct snd_pcm_hw_params below = *params;
+    set_interval(&below, param, 0, value);
+    bool have_below = refine(pcm, &below) == 0;
+    if (!have_above && !have_below) {
+        return -EINVAL;
+    }
+    unsigned int nearest;
+    if (have_above && (!have_below ||
+            interval_min(&above, param) - value < value - interval_max(&below, param))) {
+        nearest = interval_min(&above, param);
+    } else {
+        nearest = interval_max(&below, param);
+    }
+    set_interval(params, param, nearest, nearest);
+    return refine(pcm, params);
+}
+
+int piep_raw_negotiate(struct raw_pcm *pcm, unsigned int channels, unsigned int *rate_hz,
+        unsigned int period_time_us, unsigned int buffer_time_us, unsigned long *period_size_frames,
+        unsigned long *buffer_size_frames, unsigned long *max_buffer_size_frames) {
+    // The kernel refuses new parameters while the buffer is mapped.
+    if (pcm->data) {
+        munmap(pcm->data, pcm->data_size);
+        pcm->data = NULL;
+    }
+    free(pcm->scratch);
+    pcm->scratch = NULL;
+    ioctl(pcm->fd, SNDRV_PCM_IOCTL_DROP);
+    ioctl(pcm->fd, SNDRV_PCM_IOCTL_HW_FREE);
+
+    struct snd_pcm_hw_params params;
+    params_any(&params);
+    int err;
+    if ((err = refine(pcm, &params)) < 0) {
+        return err;
+    }
+    // Prefer mapping the buffer, so that writes don't need a system call.
+    struct snd_pcm_hw_params attempt = params;
+    set_mask(&attempt, SNDRV_PCM_HW_PARAM_ACCESS, SNDRV_PCM_ACCESS_MMAP_INTERLEAVED);
+    if (refine(pcm, &attempt) == 0) {
+        params = attempt;
+    } else {
+        set_mask(&params, SNDRV_PCM_HW_PARAM_ACCESS, SNDRV_PCM_ACCESS_RW_INTERLEAVED);
+    }
+    // Prefer our own sample format, so that frames can be copied as they are.
+    snd_pcm_format_t format = RAW_PCM_FORMAT;
+    attempt = params;
+    set_mask(&attempt, SNDRV_PCM_HW_PARAM_FORMAT, format);
+    if (refine(pcm, &attempt) == 0) {
+        params = attempt;
+    } else {
+        format = RAW_PCM_FORMAT_WIDE;
+        set_mask(&params, SNDRV_PCM_HW_PARAM_FORMAT, format);
+    }
+    set_mask(&params, SNDRV_PCM_HW_PARAM_SUBFORMAT, SNDRV_PCM_SUBFORMAT_STD);
+    if ((err = refine(pcm, &params)) < 0 ||
+            (err = refine_near(pcm, &params, SNDRV_PCM_HW_PARAM_CHANNELS, channels)) < 0) {
+        return err;
+    }
+    *max_buffer_size_frames = interval_max(&params, SNDRV_PCM_HW_PARAM_BUFFER_SIZE);
+
+    if ((err = refine_near(pcm, &params, SNDRV_PCM_HW_PARAM_RATE, *rate_hz)) < 0) {
+        return err;
+    }
+    // Negotiate sizes in frames rather than times, because the kernel's time
+    // intervals are rarely hit exactly by an integer number of microseconds.
+    unsigned int rate = interval_min(&params, SNDRV_PCM_HW_PARAM_RATE);
+    unsigned int buffer_size = (uint64_t) buffer_time_us * rate / 1000000;
+    unsigned int period_size = (uint64_t) period_time_us * rate / 1000000;
+    if ((err = refine_near(pcm, &params, SNDRV_PCM_HW_PARAM_BUFFER_SIZE, buffer_size)) < 0 ||
+            (err = refine_near(pcm, &params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE, period_size)) < 0) {
+        return err;
+    }
+    // Pin down any frame counts that are still open, the way alsa-lib would.
+    // Times and byte counts follow from these.
+    int const integer_params[] = {
+        SNDRV_PCM_HW_PARAM_SAMPLE_BITS,
+        SNDRV_PCM_HW_PARAM_FRAME_BITS,
+        SNDRV_PCM_HW_PARAM_PERIODS,
+    };
+    for (size_t i = 0; i < sizeof(integer_params) / sizeof(integer_params[0]); i++) {
+        unsigned int min = interval_min(&params, integer_params[i]);
+        if (min < interval_max(&params, integer_params[i])) {
+            set_interval(&params, integer_params[i], min, min);
+            if ((err = refine(pcm, &params)) < 0) {
+                return err;
+            }
+        }
+    }
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_HW_PARAMS, &params) < 0) {
+        return -errno;
+    }
+
+    pcm->access = param_mask(&params, SNDRV_PCM_HW_PARAM_ACCESS)->bits[0] &
+        (1u << SNDRV_PCM_ACCESS_MMAP_INTERLEAVED) ? SNDRV_PCM_ACCESS_MMAP_INTERLEAVED : SNDRV_PCM_ACCESS_RW_INTERLEAVED;
+    pcm->format = format;
+    pcm->channels = interval_min(&params, SNDRV_PCM_HW_PARAM_CHANNELS);
+    pcm->rate_hz = interval_min(&params, SNDRV_PCM_HW_PARAM_RATE);
+    pcm->period_size_frames = interval_min(&params, SNDRV_PCM_HW_PARAM_PERIOD_SIZE);
+    pcm->buffer_size_frames = interval_min(&params, SNDRV_PCM_HW_PARAM_BUFFER_SIZE);
+    pcm->frame_bytes = interval_min(&params, SNDRV_PCM_HW_PARAM_FRAME_BITS) / 8;
+    piep_raw_set_boundary(pcm);
+
+    // Same software parameters as the alsa-lib path: never start implicitly,
+    // wake up once per period, and keep monotonic timestamps.
+    struct snd_pcm_sw_params sw_params;
+    memset(&sw_params, 0, sizeof(sw_params));
+    sw_params.tstamp_mode = SNDRV_PCM_TSTAMP_ENABLE;
+    sw_params.period_step = 1;
+    sw_params.avail_min = pcm->period_size_frames;
+    sw_params.xfer_align = 1;
+    sw_params.start_threshold = pcm->boundary;
+    sw_params.stop_threshold = pcm->buffer_size_frames;
+    sw_params.boundary = pcm->boundary;
+    sw_params.proto = SNDRV_PCM_VERSION;
+    sw_params.tstamp_type = SNDRV_PCM_TSTAMP_TYPE_MONOTONIC;
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SW_PARAMS, &sw_params) < 0) {
+        return -errno;
+    }
+    pcm->control->avail_min = pcm->period_size_frames;
+
+    if (pcm->access == SNDRV_PCM_ACCESS_MMAP_INTERLEAVED) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        pcm->data_size = (pcm->buffer_size_frames * pcm->frame_bytes + page_size - 1) / page_size * page_size;
+        pcm->data = mmap(NULL, pcm->data_size, PROT_READ | PROT_WRITE, MAP_SHARED, pcm->fd,
+            SNDRV_PCM_MMAP_OFFSET_DATA);
+        if (pcm->data == MAP_FAILED) {
+            pcm->data = NULL;
+            return -errno;
+        }
+    } else {
+        pcm->scratch = malloc(pcm->period_size_frames * pcm->frame_bytes);
+        if (!pcm->scratch) {
+            return -ENOMEM;
+        }
+    }
+
+    if ((err = piep_raw_prepare(pcm)) < 0) {
+        return err;
+    }
+    *rate_hz = pcm->rate_hz;
+    *period_size_frames = pcm->period_size_frames;
+    *buffer_size_frames = pcm->buffer_size_frames;
+    return 0;
+}
+
+void piep_raw_dump(struct raw_pcm *pcm, FILE *file) {
+    fprintf(file,
+        "Raw kernel PCM %s (protocol %d.%d.%d)\n"
+        "  access: %s\n"
+        "  format: %s\n"
+        "  channels: %u\n"
+        "  rate: %u\n"
+        "  period_size: %lu\n"
+        "  buffer_size: %lu\n"
+        "  boundary: %lu\n"
+        "  status/control: %s\n",
+        pcm->path, SNDRV_PROTOCOL_MAJOR(pcm->protocol_version),
+        SNDRV_PROTOCOL_MINOR(pcm->protocol_version), SNDRV_PROTOCOL_MICRO(pcm->protocol_version),
+        pcm->data ? "MMAP_INTERLEAVED" : "RW_INTERLEAVED", pcm->format == RAW_PCM_FORMAT ? "S16" : "S32",
+        pcm->channels, pcm->rate_hz,
+        pcm->period_size_frames, pcm->buffer_size_frames, pcm->boundary,
+        pcm->use_sync_ptr ? "SYNC_PTR" : "mmap");
+}
+
+// Does what the WRITEI_FRAMES ioctl does on a non-blocking device, for
+// devices in memory.
+static long piep_raw_memory_write(struct raw_pcm *pcm, void const *buffer, unsigned long frames) {
+    int err = piep_raw_state_error(pcm);
+    if (err < 0) {
+        return err;
+    }
+    unsigned char const *source = buffer;
+    unsigned long written = 0;
+    while (written < frames) {
+        snd_pcm_uframes_t avail = piep_raw_avail_frames(pcm);
+        if (avail == 0) {
+            break;
+        }
+        snd_pcm_uframes_t offset = pcm->control->appl_ptr % pcm->buffer_size_frames;
+        snd_pcm_uframes_t count = frames - written;
+        if (count > avail) {
+            count = avail;
+        }
+        if (count > pcm->buffer_size_frames - offset) {
+            count = pcm->buffer_size_frames - offset;
+        }
+        memcpy((unsigned char *) pcm->memory_buffer + offset * pcm->frame_bytes,
+            source + written * pcm->frame_bytes, count * pcm->frame_bytes);
+        pcm->control->appl_ptr = piep_raw_advance(pcm, pcm->control->appl_ptr, count);
+        written += count;
+    }
+    return written > 0 ? (long) written : -EAGAIN;
+}
+
+// Writes frames through the WRITEI_FRAMES ioctl, for devices that can't be
+// mapped.
+static long piep_raw_write_ioctl(struct raw_pcm *pcm, void const *buffer, unsigned long frames) {
+    if (pcm->memory) {
+        return piep_raw_memory_write(pcm, buffer, frames);
+    }
+    struct snd_xferi transfer = {
+        .buf = (void *) buffer,
+        .frames = frames,
+    };
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_WRITEI_FRAMES, &transfer) < 0) {
+        return transfer.result > 0 ? transfer.result : -errno;
+    }
+    return transfer.result;
+}
+
+// Stores mono 16-bit samples as frames in the device's format, with each
+// sample on every channel.
+static void piep_raw_convert(struct raw_pcm *pcm, void *dest, int16_t const *source, unsigned long frames) {
+    if (pcm->format == RAW_PCM_FORMAT && pcm->channels == 1) {
+        memcpy(dest, source, frames * sizeof(int16_t));
+    } else if (pcm->format == RAW_PCM_FORMAT) {
+        int16_t *frame = dest;
+        for (unsigned long i = 0; i < frames; i++) {
+            for (unsigned int channel = 0; channel < pcm->channels; channel++) {
+                *frame++ = source[i];
+            }
+        }
+    } else {
+        int32_t *frame = dest;
+        for (unsigned long i = 0; i < frames; i++) {
+            int32_t wide = (int32_t) source[i] * 65536;
+            for (unsigned int channel = 0; channel < pcm->channels; channel++) {
+                *frame++ = wide;
+            }
+        }
+    }
+}
+
+long piep_raw_writei(struct raw_pcm *pcm, void const *buffer, unsigned long frames) {
+    return piep_raw_write_looped(pcm, buffer, frames, 0, frames);
+}
+
+long piep_raw_write_looped(struct raw_pcm *pcm, void const *loop, unsigned long loop_frames,
+        unsigned long loop_offset_frames, unsigned long frames) {
+    int16_t const *source = loop;
+    if (!pcm->data) {
+        // One ioctl per period at most. Writes that wrap around the end of
+        // the loop, or that need converting, go through the scratch buffer.
+        bool native = pcm->format == RAW_PCM_FORMAT && pcm->channels == 1;
+        unsigned long written = 0;
+        while (written < frames) {
+            unsigned long count = frames - written;
+            if (count > pcm->period_size_frames) {
+                count = pcm->period_size_frames;
+            }
+            void const *buffer = source + loop_offset_frames;
+            if (!native || count > loop_frames - loop_offset_frames) {
+                unsigned char *dest = pcm->scratch;
+                for (unsigned long tiled = 0, offset = loop_offset_frames; tiled < count; ) {
+                    unsigned long n = loop_frames - offset;
+                    if (n > count - tiled) {
+                        n = count - tiled;
+                    }
+                    piep_raw_convert(pcm, dest + tiled * pcm->frame_bytes, source + offset, n);
+                    tiled += n;
+                    offset = 0;
+                }
+                buffer = pcm->scratch;
+            }
+            long result = piep_raw_write_ioctl(pcm, buffer, count);
+            if (result < 0) {
+                return written > 0 ? (long) written : result;
+            }
+            written += result;
+            loop_offset_frames = (loop_offset_frames + result) % loop_frames;
+            if ((unsigned long) result < count) {
+                break;
+            }
+        }
+        return written;
+    }
+
+    unsigned long written = 0;
+    while (written < frames) {
+        int err = piep_raw_sync(pcm);
+        if (err == 0) {
+            err = piep_raw_state_error(pcm);
+        }
+        if (err < 0) {
+            return written > 0 ? (long) written : err;
+        }
+        snd_pcm_uframes_t avail = piep_raw_avail_frames(pcm);
+        if (avail == 0) {
+            break;
+        }
+
+        // Copy as much as fits before the end of the buffer and the end of
+        // the loop, whichever comes first.
+        snd_pcm_uframes_t offset = pcm->control->appl_ptr % pcm->buffer_size_frames;
+        snd_pcm_uframes_t count = frames - written;
+        if (count > avail) {
+            count = avail;
+        }
+        if (count > pcm->buffer_size_frames - offset) {
+            count = pcm->buffer_size_frames - offset;
+        }
+        if (count > loop_frames - loop_offset_frames) {
+            count = loop_frames - loop_offset_frames;
+        }
+        piep_raw_convert(pcm, (unsigned char *) pcm->data + offset * pcm->frame_bytes, source + loop_offset_frames,
+            count);
+        pcm->control->appl_ptr = piep_raw_advance(pcm, pcm->control->appl_ptr, count);
+        written += count;
+        loop_offset_frames = (loop_offset_frames + count) % loop_frames;
+    }
+    if (written == 0 && frames > 0) {
+        return -EAGAIN;
+    }
+    // Publish the new application pointer if the kernel can't see it.
+    int err = pcm->use_sync_ptr ? piep_raw_sync(pcm) : 0;
+    return err < 0 ? err : (long) written;
+}
+
+long piep_raw_memory_play(struct raw_pcm *pcm, void *buffer, unsigned long frames) {
+    if (pcm->status->state != SNDRV_PCM_STATE_RUNNING) {
+        return 0;
+    }
+    unsigned char *dest = buffer;
+    unsigned long played = 0;
+    while (played < frames) {
+        snd_pcm_uframes_t queued = pcm->buffer_size_frames - piep_raw_avail_frames(pcm);
+        if (queued == 0) {
+            // Ran dry with more to play, as when the application is late.
+            pcm->status->state = SNDRV_PCM_STATE_XRUN;
+            break;
+        }
+        snd_pcm_uframes_t offset = pcm->status->hw_ptr % pcm->buffer_size_frames;
+        snd_pcm_uframes_t count = frames - played;
+        if (count > queued) {
+            count = queued;
+        }
+        if (count > pcm->buffer_size_frames - offset) {
+            count = pcm->buffer_size_frames - offset;
+        }
+        memcpy(dest + played * pcm->frame_bytes,
+            (unsigned char const *) pcm->memory_buffer + offset * pcm->frame_bytes, count * pcm->frame_bytes);
+        pcm->status->hw_ptr = piep_raw_advance(pcm, pcm->status->hw_ptr, count);
+        played += count;
+    }
+    return played;
+}
+
+long piep_raw_memory_suspend(struct raw_pcm *pcm) {
+    if (pcm->status->state != SNDRV_PCM_STATE_RUNNING && pcm->status->state != SNDRV_PCM_STATE_PREPARED) {
+        return 0;
+    }
+    pcm->status->state = SNDRV_PCM_STATE_SUSPENDED;
+    return pcm->buffer_size_frames - piep_raw_avail_frames(pcm);
+}
+
+int piep_raw_poll_descriptor(struct raw_pcm *pcm) {
+    return pcm->fd;
+}
+
+long piep_raw_avail(struct raw_pcm *pcm) {
+    int err = piep_raw_sync(pcm);
+    if (err == 0) {
+        err = piep_raw_state_error(pcm);
+    }
+    return err < 0 ? err : piep_raw_avail_frames(pcm);
+}
+
+int piep_raw_prepare(struct raw_pcm *pcm) {
+    if (pcm->memory) {
+        pcm->status->hw_ptr = 0;
+        pcm->control->appl_ptr = 0;
+        pcm->status->state = SNDRV_PCM_STATE_PREPARED;
+        return 0;
+    }
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_PREPARE) < 0) {
+        return -errno;
+    }
+    // Preparing resets both pointers; pick up the kernel's values.
+    if (pcm->use_sync_ptr) {
+        pcm->sync_ptr.flags = SNDRV_PCM_SYNC_PTR_HWSYNC | SNDRV_PCM_SYNC_PTR_APPL | SNDRV_PCM_SYNC_PTR_AVAIL_MIN;
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SYNC_PTR, &pcm->sync_ptr) < 0) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+int piep_raw_start(struct raw_pcm *pcm) {
+    if (pcm->memory) {
+        if (pcm->status->state != SNDRV_PCM_STATE_PREPARED) {
+            return -EBADFD;
+        }
+        pcm->status->state = SNDRV_PCM_STATE_RUNNING;
+        return 0;
+    }
+    return ioctl(pcm->fd, SNDRV_PCM_IOCTL_START) < 0 ? -errno : 0;
+}
+
+int piep_raw_drop(struct raw_pcm *pcm) {
+    if (pcm->memory) {
+        pcm->status->state = SNDRV_PCM_STATE_SETUP;
+        return 0;
+    }
+    return ioctl(pcm->fd, SNDRV_PCM_IOCTL_DROP) < 0 ? -errno : 0;
+}
+
+int piep_raw_resume(struct raw_pcm *pcm) {
+    // Like most hardware, devices in memory can't resume, so they have to be
+    // prepared again instead.
+    if (pcm->memory) {
+        return -ENOSYS;
+    }
+    return ioctl(pcm->fd, SNDRV_PCM_IOCTL_RESUME) < 0 ? -errno : 0;
+}
+
+int piep_raw_trigger_time(struct raw_pcm *pcm, struct timespec *time) {
+    if (pcm->memory) {
+        return -ENOSYS;
+    }
+    struct snd_pcm_status status;
+    memset(&status, 0, sizeof(status));
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_STATUS, &status) < 0) {
+        return -errno;
+    }
+    time->tv_sec = status.trigger_tstamp.tv_sec;
+    time->tv_nsec = status.trigger_tstamp.tv_nsec;
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef RAWPCM_H
+#define RAWPCM_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+// A playback PCM that is driven straight through the kernel's ioctl
+// interface on /dev/snd/pcmC*D*p, without alsa-lib. Only what piep needs is
+// supported: callers always write mono 16-bit samples, which go out as
+// interleaved S16, or as S32 to devices that don't take S16, on however many
+// channels the device wants.
+//
+// Functions that can fail return a negative errno value, just like their
+// alsa-lib counterparts, so callers can treat both the same way. Writes never
+// block: when the buffer is full they return -EAGAIN, and the caller should
+// wait for POLLOUT on the poll descriptor.
+struct raw_pcm;
+
+// Opens the given device, which is either a path to a PCM device node, or an
+// ALSA name of the form "hw:CARD" or "hw:CARD,DEVICE". CARD may be an index
+// or a card ID.
+int piep_raw_open(struct raw_pcm **pcm, char const *name);
+
+// Opens a mono device that exists only in memory, for exercising the engine
+// without hardware. It has the given setup, with a mapped buffer or with ioctl
+// writes, and is prepared. Frames written to it come out of
+// piep_raw_memory_play once it is started. It goes through the same states as
+// a kernel device, except that it can't resume and has no trigger time.
+int piep_raw_open_memory(struct raw_pcm **pcm, bool mmap, unsigned int rate_hz,
+        unsigned long period_size_frames, unsigned long buffer_size_frames);
+void piep_raw_close(struct raw_pcm *pcm);
+
+// Negotiates hardware parameters as close as possible to the requested
+// channel count, rate and times, in the sample format closest to ours, sets up software parameters like piep's
+// alsa-lib path does, maps the buffer and prepares the stream. Stores the
+// outcome in the output arguments. May be called again to renegotiate.
+int piep_raw_negotiate(struct raw_pcm *pcm, unsigned int channels, unsigned int *rate_hz,
+        unsigned int period_time_us, unsigned int buffer_time_us, unsigned long *period_size_frames,
+        unsigned long *buffer_size_frames, unsigned long *max_buffer_size_frames);
+
+// Prints the negotiated setup, similar to snd_pcm_dump.
+void piep_raw_dump(struct raw_pcm *pcm, FILE *file);
+
+long piep_raw_writei(struct raw_pcm *pcm, void const *buffer, unsigned long frames);
+
+// Writes frames from a loop of loop_frames frames, starting at the given
+// offset into it and wrapping around as often as needed. With a mapped
+// buffer, the loop is copied straight into it, converted to the device's
+// format and channel count on the way if need be.
+long piep_raw_write_looped(struct raw_pcm *pcm, void const *loop, unsigned long loop_frames,
+        unsigned long loop_offset_frames, unsigned long frames);
+long piep_raw_avail(struct raw_pcm *pcm);
+int piep_raw_prepare(struct raw_pcm *pcm);
+int piep_raw_start(struct raw_pcm *pcm);
+int piep_raw_drop(struct raw_pcm *pcm);
+int piep_raw_resume(struct raw_pcm *pcm);
+
+// Plays up to the given number of frames from a running device in memory into
+// the buffer, freeing up their space. Returns the number of frames played. If
+// the buffer runs out first, the device underruns.
+long piep_raw_memory_play(struct raw_pcm *pcm, void *buffer, unsigned long frames);
+
+// Suspends a device in memory, as a system suspend does. Returns the number of
+// frames still queued, which will never be played.
+long piep_raw_memory_suspend(struct raw_pcm *pcm);
+
+// Returns the file descriptor to poll for POLLOUT.
+int piep_raw_poll_descriptor(struct raw_pcm *pcm);
+
+// Returns the CLOCK_MONOTONIC time at which the stream was last started.
+int piep_raw_trigger_time(struct raw_pcm *pcm, struct timespec *time);
+
+#endif
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+
+#include "verify.h"
+
+#include <alsa/asoundlib.h>
+
+#include "analyze.h"
+#include "engine.h"
+#include "rawpcm.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PI 3.1415926535897932384626433
+
+// How much audio verify_playback renders and analyses.
+#define VERIFY_TIME_S 10
+// How many times faster than real time verify_playback requires rendering to
+// be.
+#define VERIFY_MIN_SPEED 100
+// Besides the period size playback asks for first, verify_playback renders
+// with periods this small, like those of dmix.
+#define VERIFY_SMALL_PERIOD_FRAMES 1024
+// Most suspends verify_playback puts each render through.
+#define VERIFY_MAX_SUSPENDS 3
+// Points along a sweep at which verify_playback measures its frequency.
+#define VERIFY_SWEEP_POINTS 50
+// Points per wave at which verify_playback looks for the peak of a waveform's
+// band-limited series. That is 16 per wave of the highest harmonic that
+// wavetables hold.
+#define VERIFY_SERIES_POINTS 8192
+
+// The ways of writing to a device that verify_playback renders through, each
+// into a device that only exists in memory.
+enum verify_path {
+    VERIFY_ALSA_MMAP,
+    VERIFY_ALSA_RW,
+    VERIFY_RAW_MMAP,
+    VERIFY_RAW_RW,
+    VERIFY_PATH_COUNT
+};
+
+static char const *const verify_path_names[VERIFY_PATH_COUNT] = {
+    "alsa-mmap", "alsa-rw", "raw-mmap", "raw-rw"
+};
+
+// What came of rendering through one write path.
+struct verify_result {
+    // The first rendered frame that differs from the reference, or the
+    // number of frames rendered if none does.
+    size_t mismatch_frame;
+    // Set if playback stopped before all frames were rendered.
+    bool stalled;
+    unsigned long underruns;
+    unsigned long suspends;
+};
+
+static double monotonic_s(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void report_check(FILE *report, char const *name, bool ok, bool *all_ok, char const *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(report, "%-12s %-4s ", name, ok ? "ok" : "FAIL");
+    vfprintf(report, format, args);
+    fprintf(report, "\n");
+    va_end(args);
+    *all_ok = *all_ok && ok;
+}
+
+// A small xorshift generator for the timing of the renders, so that
+// verify_playback leaves the C library's generator alone.
+static uint32_t verify_random(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Opens an alsa-lib stream with the given access and geometry that appends
+// everything written to it to the file. This is the file plugin on top of the
+// null plugin, which takes frames as fast as they come.
+static int open_file_pcm(snd_pcm_t **pcm, FILE *file, bool mmap, unsigned int rate_hz,
+        snd_pcm_uframes_t period_size_frames, snd_pcm_uframes_t buffer_size_frames) {
+    char text[128];
+    snprintf(text, sizeof(text), "pcm.piep_verify { type file slave.pcm { type null } file %d format raw }",
+        fileno(file));
+    snd_input_t *input;
+    int err = snd_input_buffer_open(&input, text, -1);
+    if (err < 0) {
+        return err;
+    }
+    snd_config_t *config;
+    err = snd_config_top(&config);
+    if (err == 0) {
+        err = snd_config_load(config, input);
+        if (err == 0) {
+            err = snd_pcm_open_lconf(pcm, "piep_verify", SND_PCM_STREAM_PLAYBACK, 0, config);
+        }
+        snd_config_delete(config);
+    }
+    snd_input_close(input);
+    if (err < 0) {
+        return err;
+    }
+
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_hw_params_alloca(&hw_params);
+    if ((err = snd_pcm_hw_params_any(*pcm, hw_params)) < 0 ||
+            (err = snd_pcm_hw_params_set_access(*pcm, hw_params,
+                mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED)) < 0 ||
+            (err = snd_pcm_hw_params_set_format(*pcm, hw_params, SND_PCM_FORMAT_S16)) < 0 ||
+            (err = snd_pcm_hw_params_set_channels(*pcm, hw_params, 1)) < 0 ||
+            (err = snd_pcm_hw_params_set_rate(*pcm, hw_params, rate_hz, 0)) < 0 ||
+            (err = snd_pcm_hw_params_set_period_size(*pcm, hw_params, period_size_frames, 0)) < 0 ||
+            (err = snd_pcm_hw_params_set_buffer_size(*pcm, hw_params, buffer_size_frames)) < 0 ||
+            (err = snd_pcm_hw_params(*pcm, hw_params)) < 0) {
+        snd_pcm_close(*pcm);
+        *pcm = NULL;
+        return err;
+    }
+    return 0;
+}
+
+// Sets up an engine for the configuration on a device in memory with the
+// given write path and period size. The alsa-lib paths append what they play
+// to the file. Hands out the device too, which the engine owns.
+static int verify_open(struct piep **piep, struct piep_config const *config, enum verify_path path,
+        snd_pcm_uframes_t period_size_frames, FILE *file, snd_pcm_t **pcm, struct raw_pcm **raw) {
+    unsigned int rate_hz = config->rate_hz ? config->rate_hz : DEFAULT_RATE_HZ;
+    snd_pcm_uframes_t buffer_size_frames = BUFFER_PERIODS * period_size_frames;
+    bool mmap = path == VERIFY_ALSA_MMAP || path == VERIFY_RAW_MMAP;
+    *pcm = NULL;
+    *raw = NULL;
+    int err = path == VERIFY_RAW_MMAP || path == VERIFY_RAW_RW ?
+        piep_raw_open_memory(raw, mmap, rate_hz, period_size_frames, buffer_size_frames) :
+        open_file_pcm(pcm, file, mmap, rate_hz, period_size_frames, buffer_size_frames);
+    if (err < 0) {
+        return err;
+    }
+    return piep_open_output(piep, config, *pcm, mmap, *raw, rate_hz, period_size_frames, buffer_size_frames);
+}
+
+// Plays from the engine through a device in memory, the way hardware would,
+// but in bursts of random length. Now and then it runs the device dry or
+// suspends it, and checks that the engine recovers. Compares what comes out
+// with the reference as it goes; frames that were queued when the device was
+// suspended are lost, so the reference skips them.
+static int verify_render_raw(struct piep *piep, struct raw_pcm *raw, int16_t const *reference, int16_t *rendered,
+        size_t render_size_frames, uint32_t *random, struct verify_result *result) {
+    struct piep_stats stats;
+    piep_get_stats(piep, &stats);
+    struct pollfd fd = { .fd = -1, .events = POLLOUT, .revents = POLLOUT };
+    size_t played_frames = 0;
+    size_t lost_frames = 0;
+    unsigned int suspends = 0;
+    unsigned int idle = 0;
+    while (played_frames < render_size_frames) {
+        piep_wait_for_producer(piep);
+        int err = piep_handle_events(piep, &fd, 1);
+        if (err < 0) {
+            return err;
+        }
+
+        uint32_t r = verify_random(random);
+        if (r % 8 == 0 && suspends < VERIFY_MAX_SUSPENDS) {
+            lost_frames += piep_raw_memory_suspend(raw);
+            suspends++;
+            continue;
+        }
+        // Asking for more than the buffer holds runs it dry.
+        size_t count = r % 8 == 1 ? stats.buffer_size_frames + 1 : 1 + r / 8 % stats.period_size_frames;
+        if (count > render_size_frames - played_frames) {
+            count = render_size_frames - played_frames;
+        }
+        long played = piep_raw_memory_play(raw, rendered + played_frames, count);
+        if (played == 0 && ++idle > 2) {
+            result->stalled = true;
+            break;
+        } else if (played > 0) {
+            idle = 0;
+        }
+        int16_t const *expected = reference + lost_frames + played_frames;
+        for (long i = 0; i < played; i++) {
+            if (rendered[played_frames + i] != expected[i]) {
+                result->mismatch_frame = played_frames + i;
+                return 0;
+            }
+        }
+        played_frames += played;
+    }
+    result->mismatch_frame = played_frames;
+    return 0;
+}
+
+// Drives the engine through an alsa-lib stream, which takes frames as fast as
+// they come and never underruns, and reads back what it played.
+static int verify_render_alsa(struct piep *piep, snd_pcm_t *pcm, FILE *file, int16_t const *reference,
+        int16_t *rendered, size_t render_size_frames, struct verify_result *result) {
+    unsigned int idle = 0;
+    struct piep_stats stats;
+    for (piep_get_stats(piep, &stats); stats.frames_written < render_size_frames; piep_get_stats(piep, &stats)) {
+        piep_wait_for_producer(piep);
+        int err = piep_write_period(piep);
+        if (err == -EAGAIN && ++idle > 2) {
+            result->stalled = true;
+            break;
+        } else if (err < 0 && err != -EAGAIN) {
+            return err;
+        } else if (err == 0) {
+            idle = 0;
+        }
+    }
+    int err = snd_pcm_drain(pcm);
+    if (err < 0) {
+        return err;
+    }
+    rewind(file);
+    size_t rendered_frames = fread(rendered, sizeof(int16_t), render_size_frames, file);
+    result->mismatch_frame = 0;
+    while (result->mismatch_frame < rendered_frames &&
+            rendered[result->mismatch_frame] == reference[result->mismatch_frame]) {
+        result->mismatch_frame++;
+    }
+    if (rendered_frames < render_size_frames) {
+        result->stalled = true;
+    }
+    return 0;
+}
+
+// Renders through the given write path and period size into a fresh engine.
+static int verify_render(struct piep_config const *config, enum verify_path path,
+        snd_pcm_uframes_t period_size_frames, int16_t const *reference, int16_t *rendered,
+        size_t render_size_frames, uint32_t *random, struct verify_result *result) {
+    *result = (struct verify_result) { 0 };
+    bool raw = path == VERIFY_RAW_MMAP || path == VERIFY_RAW_RW;
+    FILE *file = NULL;
+    if (!raw && !(file = tmpfile())) {
+        return -errno;
+    }
+    struct piep *piep;
+    snd_pcm_t *pcm;
+    struct raw_pcm *raw_pcm;
+    int err = verify_open(&piep, config, path, period_size_frames, file, &pcm, &raw_pcm);
+    if (err == 0) {
+        err = raw ? verify_render_raw(piep, raw_pcm, reference, rendered, render_size_frames, random, result) :
+            verify_render_alsa(piep, pcm, file, reference, rendered, render_size_frames, result);
+        struct piep_stats stats;
+        piep_get_stats(piep, &stats);
+        result->underruns = stats.underruns;
+        result->suspends = stats.suspends;
+        piep_close(piep);
+    }
+    if (file) {
+        fclose(file);
+    }
+    return err;
+}
+
+// Checks that a tone's clip loops seamlessly and sounds as it should.
+static void verify_tone(struct piep_config const *config, struct piep_source const *source, unsigned int rate_hz,
+        int16_t const *looped, size_t frames, FILE *report, bool *all_ok) {
+    enum piep_waveform waveform = config->waveform;
+    float frequency_hz = config->frequency_hz;
+    float amplitude = config->amplitude;
+    int16_t const *clip = source->clip;
+    unsigned int clip_size_frames = source->clip_size_frames;
+
+    // A tone's clip holds whole waves, so looping it must not add a jump
+    // larger than the largest one inside it.
+    unsigned int looped_step = piep_max_step(clip, clip_size_frames, true);
+    unsigned int inner_step = piep_max_step(clip, clip_size_frames, false);
+    report_check(report, "continuity", looped_step <= inner_step, all_ok,
+        "largest step %u with the clip of %u frames looped, %u within it", looped_step,
+        clip_size_frames, inner_step);
+
+    // The rounded frequency may be off from the requested one by as much
+    // as fitting whole waves into the longest clip requires.
+    double expected_hz = source->frequency_hz;
+    double tolerance_hz = 0.5 / TONE_MAX_CLIP_TIME_S + 1e-3;
+    size_t block_frames = rate_hz / 100;
+    if (block_frames < 4 * rate_hz / expected_hz) {
+        block_frames = 4 * rate_hz / expected_hz;
+    }
+    double measured_hz = piep_measure_frequency(looped, frames, rate_hz, expected_hz, block_frames);
+    report_check(report, "frequency", fabs(measured_hz - frequency_hz) <= tolerance_hz, all_ok,
+        "%.4f Hz, requested %.4f Hz, allowed error %.4f Hz", measured_hz, frequency_hz, tolerance_hz);
+
+    // A whole number of clips holds a whole number of waves, so the
+    // harmonics fall exactly on the bins and don't leak.
+    size_t analysis_frames = frames / clip_size_frames * clip_size_frames;
+    double harmonics_hz[GOERTZEL_BINS];
+    double levels[GOERTZEL_BINS];
+    double phases[GOERTZEL_BINS];
+    unsigned int num_harmonics = source->num_harmonics;
+    for (unsigned int i = 0; i < GOERTZEL_BINS; i++) {
+        unsigned int harmonic = i + 1;
+        bool in_table = harmonic <= num_harmonics;
+        harmonics_hz[i] = in_table && harmonic * expected_hz < 0.5 * rate_hz ? harmonic * expected_hz : 0.0;
+    }
+    piep_goertzel(looped, analysis_frames, rate_hz, harmonics_hz, levels, phases);
+
+    // The waveform is normalized to its peak, which for anything but a sine
+    // is not that of its fundamental. Work out the peak of the same band
+    // limited series, independently of the wavetable code, to know what
+    // the fundamental should be.
+    double series_peak = 0.0;
+    for (unsigned int i = 0; i < VERIFY_SERIES_POINTS; i++) {
+        double theta = 2.0 * PI * i / VERIFY_SERIES_POINTS;
+        double value = 0.0;
+        for (unsigned int harmonic = 1; harmonic <= num_harmonics; harmonic++) {
+            value += piep_harmonic_amplitude(waveform, harmonic) * sin(harmonic * theta);
+        }
+        series_peak = fmax(series_peak, fabs(value));
+    }
+    double expected_level = amplitude * piep_harmonic_amplitude(waveform, 1) / series_peak;
+    report_check(report, "level", fabs(levels[0] - expected_level) <= 0.01 * amplitude + 1e-3, all_ok,
+        "fundamental %.4f, expected %.4f", levels[0], expected_level);
+
+    // The harmonics must have the shape of the waveform's Fourier series.
+    double worst_error = 0.0;
+    unsigned int worst_harmonic = 1;
+    for (unsigned int i = 1; i < GOERTZEL_BINS; i++) {
+        if (harmonics_hz[i] == 0.0) {
+            continue;
+        }
+        double expected = fabs(piep_harmonic_amplitude(waveform, i + 1) / piep_harmonic_amplitude(waveform, 1));
+        double error = fabs(levels[i] / levels[0] - expected);
+        if (error > worst_error) {
+            worst_error = error;
+            worst_harmonic = i + 1;
+        }
+    }
+    report_check(report, "harmonics", worst_error <= 0.01, all_ok,
+        "largest relative error %.4f at harmonic %u", worst_error, worst_harmonic);
+}
+
+// Returns the frequency that the sweep should be at, the given time into it.
+// Worked out from the configuration, independently of the synthesis.
+static double sweep_frequency(struct piep_config const *config, double time_s) {
+    double t = time_s / config->sweep_time_s;
+    if (config->sweep == PIEP_SWEEP_LOGARITHMIC) {
+        return config->frequency_hz * pow(config->end_frequency_hz / config->frequency_hz, t);
+    } else {
+        return config->frequency_hz + t * (config->end_frequency_hz - config->frequency_hz);
+    }
+}
+
+// Checks that a sweep is continuous, at full level, and at the frequency it
+// should be at along the way.
+static void verify_sweep(struct piep_config const *config, struct piep_source const *source, unsigned int rate_hz,
+        int16_t const *swept, size_t frames, FILE *report, bool *all_ok) {
+    double max_hz = fmax(config->frequency_hz, config->end_frequency_hz);
+    double peak = config->amplitude * 0x7FFF;
+
+    // No step may be larger than that of a sine at the highest frequency.
+    unsigned int step = piep_max_step(swept, frames, false);
+    double max_step = 2.0 * peak * sin(PI * max_hz / rate_hz) * 1.01 + 2.0;
+    report_check(report, "continuity", step <= max_step, all_ok,
+        "largest step %u, allowed %.0f", step, max_step);
+
+    unsigned int largest = 0;
+    for (size_t i = 0; i < frames; i++) {
+        unsigned int magnitude = abs(swept[i]);
+        if (magnitude > largest) {
+            largest = magnitude;
+        }
+    }
+    report_check(report, "level", fabs(largest - peak) <= 0.01 * peak + 2.0, all_ok,
+        "peak %u, expected %.0f", largest, peak);
+
+    // Measure at points along the way, over windows of at least a few waves,
+    // short enough that the frequency doesn't run off by half a wave in a block.
+    // Where it changes too fast for that, skip the point.
+    size_t sweep_frames = source->sweep_size_frames;
+    double worst_error = 0.0;
+    double worst_hz = 0.0;
+    double worst_measured_hz = 0.0;
+    unsigned int num_points = 0;
+    for (unsigned int point = 0; point < VERIFY_SWEEP_POINTS; point++) {
+        size_t centre = (point + 0.5) * frames / VERIFY_SWEEP_POINTS;
+        double time_s = (double) (centre % sweep_frames) / rate_hz;
+        double expected_hz = sweep_frequency(config, time_s);
+        double slope_hz_per_s = fabs(sweep_frequency(config, time_s + 1e-3) -
+            sweep_frequency(config, time_s - 1e-3)) / 2e-3;
+        double window_frames = fmin(fmax(rate_hz / 50, 8.0 * rate_hz / expected_hz), rate_hz / sqrt(slope_hz_per_s));
+        if (window_frames < 4.0 * rate_hz / expected_hz) {
+            continue;
+        }
+        size_t start = centre - (size_t) window_frames / 2;
+        size_t end = start + (size_t) window_frames;
+        if (window_frames > centre || end > frames || start / sweep_frames != end / sweep_frames) {
+            continue;
+        }
+        double measured_hz = piep_measure_frequency(swept + start, end - start, rate_hz, expected_hz,
+            (end - start) / 4);
+        // Allow for how much the frequency changes within the window.
+        double tolerance = 0.01 + 0.5 * slope_hz_per_s * window_frames / rate_hz / expected_hz;
+        double error = isnan(measured_hz) ? INFINITY : fabs(measured_hz - expected_hz) / expected_hz / tolerance;
+        if (error >= worst_error) {
+            worst_error = error;
+            worst_hz = expected_hz;
+            worst_measured_hz = measured_hz;
+        }
+        num_points++;
+    }
+    report_check(report, "frequency", worst_error <= 1.0, all_ok,
+        "%.4f Hz where %.4f Hz was due, the worst of %u points at %.0f%% of the allowed error",
+        worst_measured_hz, worst_hz, num_points, 100.0 * worst_error);
+}
+
+// Renders through every write path that playback may take, with long and
+// short periods, while the device underruns and gets suspended, and checks
+// that each comes out exactly as the source. Then checks that the source
+// sounds as it should.
+bool verify_playback(struct piep_config const *config, FILE *report) {
+    if (config->input_path) {
+        fprintf(report, "Only generated waveforms and sweeps can be verified, not files\n");
+        return false;
+    }
+    unsigned int rate_hz = config->rate_hz ? config->rate_hz : DEFAULT_RATE_HZ;
+    struct piep_config quiet = *config;
+    quiet.log = NULL;
+    quiet.verbose = false;
+
+    // Suspends lose what was queued, so the reference must reach further.
+    snd_pcm_uframes_t period_sizes_frames[] = {
+        (uint64_t) rate_hz * PERIOD_TIME_US / 1000000,
+        VERIFY_SMALL_PERIOD_FRAMES,
+    };
+    size_t render_size_frames = (size_t) VERIFY_TIME_S * rate_hz;
+    size_t reference_size_frames = render_size_frames + VERIFY_MAX_SUSPENDS * BUFFER_PERIODS *
+        (period_sizes_frames[0] > VERIFY_SMALL_PERIOD_FRAMES ? period_sizes_frames[0] : VERIFY_SMALL_PERIOD_FRAMES);
+    int16_t *reference = malloc(reference_size_frames * sizeof(int16_t));
+    int16_t *rendered = malloc(render_size_frames * sizeof(int16_t));
+
+    // An engine that is never played, for what it should play. Problems with
+    // the configuration are reported while opening it.
+    struct piep_config checked = quiet;
+    checked.log = report;
+    struct piep *piep = NULL;
+    struct raw_pcm *raw = NULL;
+    int err = reference && rendered ? piep_raw_open_memory(&raw, true, rate_hz, VERIFY_SMALL_PERIOD_FRAMES,
+        BUFFER_PERIODS * VERIFY_SMALL_PERIOD_FRAMES) : -ENOMEM;
+    if (err == 0) {
+        err = piep_open_output(&piep, &checked, NULL, true, raw, rate_hz, VERIFY_SMALL_PERIOD_FRAMES,
+            BUFFER_PERIODS * VERIFY_SMALL_PERIOD_FRAMES);
+    }
+    if (err < 0) {
+        fprintf(report, "Failed to set up: %s\n", snd_strerror(err));
+        free(reference);
+        free(rendered);
+        return false;
+    }
+    struct piep_source source;
+    piep_get_source(piep, &source);
+    piep_render_source(piep, reference, reference_size_frames);
+    bool all_ok = true;
+
+    uint32_t random = 0x9E3779B9u;
+    for (size_t i = 0; i < sizeof(period_sizes_frames) / sizeof(period_sizes_frames[0]); i++) {
+        for (int path = 0; path < VERIFY_PATH_COUNT; path++) {
+            double start_s = monotonic_s();
+            struct verify_result result;
+            err = verify_render(&quiet, path, period_sizes_frames[i], reference, rendered, render_size_frames,
+                &random, &result);
+            double speed = VERIFY_TIME_S / (monotonic_s() - start_s);
+            char const *name = verify_path_names[path];
+            if (err < 0) {
+                report_check(report, name, false, &all_ok, "period %lu: %s", period_sizes_frames[i],
+                    snd_strerror(err));
+            } else if (result.mismatch_frame < render_size_frames && !result.stalled) {
+                // Any frame lost, repeated or out of place at a period
+                // boundary, a short write or a recovery shows up here.
+                report_check(report, name, false, &all_ok,
+                    "period %lu: frame %zu differs from the source, after %lu underruns and %lu suspends",
+                    period_sizes_frames[i], result.mismatch_frame, result.underruns, result.suspends);
+            } else if (result.stalled) {
+                report_check(report, name, false, &all_ok, "period %lu: playback stopped after %zu frames",
+                    period_sizes_frames[i], result.mismatch_frame);
+            } else {
+                report_check(report, name, speed >= VERIFY_MIN_SPEED, &all_ok,
+                    "period %lu: matches the source across %lu underruns and %lu suspends, %.0fx real time",
+                    period_sizes_frames[i], result.underruns, result.suspends, speed);
+            }
+        }
+    }
+
+    if (config->sweep != PIEP_SWEEP_NONE) {
+        verify_sweep(config, &source, rate_hz, reference, render_size_frames, report, &all_ok);
+    } else if (source.num_harmonics > 0) {
+        verify_tone(config, &source, rate_hz, reference, render_size_frames, report, &all_ok);
+    }
+
+    piep_close(piep);
+    free(rendered);
+    free(reference);
+    return all_ok;
+}
@@ -0,0 +1,18 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "libpiep.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Plays the configured tone or sweep offline through the engine, along each of
+// the write paths that playback uses, into devices in memory with long and
+// short periods, with underruns and suspends along the way. Checks that all of
+// them play exactly what was synthesized, and checks frequency, level,
+// continuity, rendering speed and, for tones, harmonics. Prints a line per
+// check to the given file. Returns whether all checks passed. Files can't be
+// verified.
+bool verify_playback(struct piep_config const *config, FILE *report);
+
+#endif